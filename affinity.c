@@ -0,0 +1,162 @@
+/*
+ * This file implements CPU placement for pipeline stages (thsh
+ * --affinity=POLICY, or a "pin POLICY" prefix on a pipeline).
+ *
+ * Stage i of a pinned pipeline is bound to a single CPU, picked from the
+ * CPUs thsh itself may run on, so the kernel does not migrate producers
+ * and consumers away from each other:
+ *
+ *     compact   adjacent stages on neighbouring cores of the same package
+ *               (socket), so data handed through a pipe stays in a shared
+ *               cache; SMT siblings are only used once every core of the
+ *               package has a stage
+ *     spread    adjacent stages on different packages, one core each,
+ *               for stages that are bound by their own work rather than
+ *               by the pipe between them
+ *     none      no pinning (the default)
+ *
+ * The placement order is built once from the topology in
+ * /sys/devices/system/cpu; with more stages than CPUs it wraps around.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+
+#include "thsh.h"
+
+int default_affinity = AFFINITY_NONE;
+
+// The CPUs we may run on, in placement order for each policy
+static int compact_order[CPU_SETSIZE];
+static int spread_order[CPU_SETSIZE];
+static int cpu_count = 0; // 0 until affinity_init(), -errno if it failed
+
+// Where a CPU sits in the machine
+struct cpu_place
+{
+    int cpu;
+    int package; // physical_package_id
+    int core;    // core_id, within the package
+    int thread;  // 0 for the first SMT sibling of a core, 1 for the next...
+    int rank;    // spread: index of the core within its package
+};
+
+static int by_compact(const void *a, const void *b)
+{
+    const struct cpu_place *x = a, *y = b;
+
+    if (x->package != y->package) return x->package - y->package;
+    if (x->thread != y->thread) return x->thread - y->thread;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static int by_spread(const void *a, const void *b)
+{
+    const struct cpu_place *x = a, *y = b;
+
+    if (x->thread != y->thread) return x->thread - y->thread;
+    if (x->rank != y->rank) return x->rank - y->rank;
+    if (x->package != y->package) return x->package - y->package;
+    return x->cpu - y->cpu;
+}
+
+// Reads the integer in /sys/devices/system/cpu/cpu<cpu>/topology/<name>
+static int read_topology(int cpu, const char *name, int fallback)
+{
+    char path[128];
+    int value = fallback;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *file = fopen(path, "re");
+    if (!file) return fallback;
+    if (fscanf(file, "%d", &value) != 1) value = fallback;
+    fclose(file);
+    return value;
+}
+
+/*
+ * Build the placement orders from the CPUs in our affinity mask and their
+ * topology. Missing topology files make every CPU its own core.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int affinity_init(void)
+{
+    static struct cpu_place places[CPU_SETSIZE];
+    cpu_set_t allowed;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return -errno;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        places[count] = (struct cpu_place){.cpu = cpu, .package = read_topology(cpu, "physical_package_id", 0),
+                                           .core = read_topology(cpu, "core_id", cpu)};
+
+        // Number the SMT siblings of a core, and the cores of a package
+        for (int i = 0; i < count; i++)
+        {
+            if (places[i].package != places[count].package) continue;
+            if (places[i].core == places[count].core)
+            {
+                places[count].thread++;
+                places[count].rank = places[i].rank;
+            }
+            else if (!places[count].thread && !places[i].thread) places[count].rank++;
+        }
+        count++;
+    }
+    if (!count) return -ENODEV;
+
+    qsort(places, count, sizeof(places[0]), by_compact);
+    for (int i = 0; i < count; i++) compact_order[i] = places[i].cpu;
+    qsort(places, count, sizeof(places[0]), by_spread);
+    for (int i = 0; i < count; i++) spread_order[i] = places[i].cpu;
+    return count;
+}
+
+/*
+ * Convert a policy name ("compact", "spread" or "none") to its
+ * AFFINITY_* value. Returns -EINVAL if name is not a policy.
+ */
+int affinity_parse(const char *name)
+{
+    if (strcmp(name, "compact") == 0) return AFFINITY_COMPACT;
+    if (strcmp(name, "spread") == 0) return AFFINITY_SPREAD;
+    if (strcmp(name, "none") == 0) return AFFINITY_NONE;
+    return -EINVAL;
+}
+
+/*
+ * Returns the CPU that stage (counting from 0) of a pipeline should be
+ * pinned to under policy, or -1 if it should not be pinned.
+ */
+int affinity_cpu(int policy, int stage)
+{
+    if (policy == AFFINITY_NONE) return -1;
+    if (!cpu_count) cpu_count = affinity_init();
+    if (cpu_count <= 0) return -1;
+
+    stage %= cpu_count;
+    return (policy == AFFINITY_COMPACT) ? compact_order[stage] : spread_order[stage];
+}
+
+/*
+ * Pin the calling thread (or the child about to exec) to cpu. Does
+ * nothing if cpu is -1.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int affinity_pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) return 0;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) return -errno;
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * This file is a benchmark harness for thsh. Each benchmark runs the
+ * freshly built ./thsh (or the shell's own functions) many times and
+ * prints the mean cost, so changes to the hot paths can be compared.
+ *
+ * Usage: ./bench [benchmark] [iterations]
+ *
+ *     startup   start-up-to-exec latency of "thsh -c", compared to
+ *               exec'ing the command directly and to feeding it to
+ *               thsh on stdin
+ *     pipeline  throughput of a four-stage pipeline moving 256 MiB, with
+ *               its stages unpinned and under each "pin" policy
+ *     parse     parse_line() throughput over corpus/parse.txt, with each
+ *               delimiter scanner the CPU supports
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "thsh.h"
+
+// Returns the current time in nanoseconds
+static long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Run argv (with stdin_text on its standard input, if not NULL) and wait
+ * for it. Its standard output is discarded.
+ *
+ * Returns the wall-clock time it took, in nanoseconds, or -1 on failure.
+ */
+static long long time_run(char *argv[], const char *stdin_text)
+{
+    int pipe_fd[2] = {-1, -1};
+    int status;
+    long long start = now_ns();
+
+    if (stdin_text && pipe(pipe_fd)) return -1;
+
+    // Otherwise the child would print our buffered output a second time
+    fflush(stdout);
+    int pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        if (stdin_text)
+        {
+            dup2(pipe_fd[0], 0);
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if (stdin_text)
+    {
+        close(pipe_fd[0]);
+        write(pipe_fd[1], stdin_text, strlen(stdin_text));
+        close(pipe_fd[1]);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+    return now_ns() - start;
+}
+
+// Runs argv iterations times and returns the mean time in microseconds
+static double mean_us(char *argv[], const char *stdin_text, int iterations)
+{
+    long long total = 0;
+
+    for (int i = 0; i < iterations; i++)
+    {
+        long long elapsed = time_run(argv, stdin_text);
+        if (elapsed < 0)
+        {
+            printf("Failed to run %s\n", argv[0]);
+            exit(1);
+        }
+        total += elapsed;
+    }
+    return total / 1000.0 / iterations;
+}
+
+// Start-up-to-exec latency of "thsh -c"
+static void bench_startup(int iterations)
+{
+    char *direct[] = {"/bin/true", NULL};
+    char *one_shot[] = {"./thsh", "-c", "true", NULL};
+    char *from_stdin[] = {"./thsh", NULL};
+
+    double base = mean_us(direct, NULL, iterations);
+    double c_mode = mean_us(one_shot, NULL, iterations);
+    double stdin_mode = mean_us(from_stdin, "true\n", iterations);
+
+    printf("===== Startup (%d runs) =====\n", iterations);
+    printf("exec true directly:     %9.1f us\n", base);
+    printf("thsh -c true:           %9.1f us (+%.1f us)\n", c_mode, c_mode - base);
+    printf("echo true | thsh:       %9.1f us (+%.1f us)\n", stdin_mode, stdin_mode - base);
+}
+
+// Throughput of a pipeline under each CPU placement policy
+static void bench_pipeline(int iterations)
+{
+    const char *policies[] = {"none", "compact", "spread"};
+    const long bytes = 256L * 1024 * 1024;
+
+    printf("===== Pipeline (%d runs, %ld MiB through 4 stages) =====\n", iterations, bytes >> 20);
+    for (int i = 0; i < 3; i++)
+    {
+        char command[128];
+        char *argv[] = {"./thsh", "-c", command, NULL};
+
+        snprintf(command, sizeof(command), "pin %s head -c %ld /dev/zero | cat | cat | wc -c", policies[i], bytes);
+        double elapsed = mean_us(argv, NULL, iterations);
+        printf("pin %-8s %9.1f us %9.1f MiB/s\n", policies[i], elapsed, (bytes >> 20) / (elapsed / 1e6));
+    }
+}
+
+// Throughput of parse_line() with each delimiter scanner
+static void bench_parse(int iterations)
+{
+    static char corpus[1024 * 1024];
+    const char *scanners[] = {"scalar", "sse2", "avx2"};
+    char *line = NULL; // grown, as read_line() does, to fit the longest line
+    size_t line_size = 0;
+    struct command_table parsed = {NULL, 0};
+    int fd = open("corpus/parse.txt", O_RDONLY);
+    ssize_t size = (fd == -1) ? -1 : read(fd, corpus, sizeof(corpus) - 1);
+
+    if (fd != -1) close(fd);
+    if (size <= 0)
+    {
+        printf("Failed to read corpus/parse.txt\n");
+        return;
+    }
+    corpus[size] = '\0';
+
+    // Sized before timing, so no pass pays for realloc()
+    for (char *cursor = corpus; *cursor;)
+    {
+        size_t length = strcspn(cursor, "\n");
+
+        if (cursor[length] == '\n') length++;
+        while (length + 1 > line_size) line_size = line_size ? 2 * line_size : MAX_INPUT;
+        cursor += length;
+    }
+    if (!(line = malloc(line_size)))
+    {
+        printf("Failed to allocate a line buffer\n");
+        return;
+    }
+
+    printf("===== Parse (%d passes over %ld KiB) =====\n", iterations, (long)size >> 10);
+    for (int i = 0; i < 3; i++)
+    {
+        long long start, elapsed;
+
+        if (scan_select(scanners[i]))
+        {
+            printf("%-8s not supported\n", scanners[i]);
+            continue;
+        }
+
+        // Lines are copied first, as parse_line() tokenizes in place
+        start = now_ns();
+        for (int pass = 0; pass < iterations; pass++)
+        {
+            for (char *cursor = corpus; *cursor;)
+            {
+                char *infile = NULL, *outfile = NULL;
+                size_t length = strcspn(cursor, "\n");
+
+                if (cursor[length] == '\n') length++;
+                memcpy(line, cursor, length);
+                line[length] = '\0';
+                parse_line(line, length, &parsed, &infile, &outfile);
+                cursor += length;
+            }
+        }
+        elapsed = now_ns() - start;
+        printf("%-8s %9.1f us/pass %9.1f MiB/s\n", scanners[i], elapsed / 1000.0 / iterations,
+               ((double)size * iterations / (1 << 20)) / (elapsed / 1e9));
+    }
+    free(line);
+}
+
+int main(int argc, char **argv)
+{
+    const char *benchmark = (argc > 1) ? argv[1] : "all";
+    int iterations = (argc > 2) ? atoi(argv[2]) : 0;
+    bool all = (strcmp(benchmark, "all") == 0);
+
+    if (all || (strcmp(benchmark, "startup") == 0)) bench_startup(iterations ? iterations : 500);
+    if (all || (strcmp(benchmark, "pipeline") == 0)) bench_pipeline(iterations ? iterations : 10);
+    if (all || (strcmp(benchmark, "parse") == 0)) bench_parse(iterations ? iterations : 200);
+    return 0;
+}
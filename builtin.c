@@ -1,33 +1,234 @@
+#define _GNU_SOURCE
 #include "thsh.h"
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 struct builtin
 {
     const char *cmd;
     int (*func)(char *args[MAX_ARGS], int stdin, int stdout);
+    int kind; // BUILTIN_PURE or BUILTIN_STATEFUL, see builtin_kind()
 };
 
-static char old_path[MAX_INPUT];
-static char cur_path[MAX_INPUT];
+// A path of any length, in a buffer grown as needed and reused
+struct path
+{
+    char *text;
+    size_t size; // bytes allocated for text
+};
+
+// The logical current directory (as the user reached it, through any
+// symlinks, so getcwd() is never needed), the previous one for "cd -",
+// and a spare buffer new paths are built in before they are swapped in
+static struct path cur_path, old_path, next_path;
+
+// The pushd/popd stack: each directory is kept open, so returning to it
+// is a single fchdir() rather than a path walk
+struct stacked_dir
+{
+    struct path path;
+    int fd; // O_PATH descriptor of the directory
+};
+
+static struct stacked_dir *dir_stack;
+static int dir_count = 0;    // entries in use; the top is dir_stack[dir_count - 1]
+static int dir_capacity = 0; // entries allocated, with their path buffers kept
+
+// Makes room for length bytes and a '\0' in path; returns 0 or -ENOMEM
+static int path_reserve(struct path *path, size_t length)
+{
+    size_t size = path->size ? path->size : 256;
+    char *grown;
+
+    if (length < path->size) return 0;
+    while (size <= length) size *= 2;
+    if (!(grown = realloc(path->text, size))) return -ENOMEM;
+    path->text = grown;
+    path->size = size;
+    return 0;
+}
+
+// Copies text into path; returns 0 or -ENOMEM
+static int path_set(struct path *path, const char *text)
+{
+    size_t length = strlen(text);
+
+    if (path_reserve(path, length)) return -ENOMEM;
+    memcpy(path->text, text, length + 1);
+    return 0;
+}
+
+static void path_swap(struct path *a, struct path *b)
+{
+    struct path temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+/*
+ * Store in next_path the absolute path that dir names when the current
+ * directory is base, removing "." and empty components and resolving ".."
+ * against the path itself (as "cd" without -P does in other shells).
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int resolve_path(const char *base, const char *dir)
+{
+    size_t length = 0;
+
+    if (path_reserve(&next_path, strlen(base) + strlen(dir) + 2)) return -ENOMEM;
+    if (dir[0] != '/')
+    {
+        length = strlen(base);
+        memcpy(next_path.text, base, length);
+    }
+
+    while (*dir)
+    {
+        size_t part = strcspn(dir, "/");
+
+        if ((part == 2) && (dir[0] == '.') && (dir[1] == '.'))
+        {
+            while ((length > 0) && (next_path.text[length - 1] != '/')) length--;
+            if (length > 0) length--; // the '/' before the removed component
+        }
+        else if ((part > 1) || ((part == 1) && (dir[0] != '.')))
+        {
+            if ((length == 0) || (next_path.text[length - 1] != '/')) next_path.text[length++] = '/';
+            memcpy(next_path.text + length, dir, part);
+            length += part;
+        }
+        dir += part;
+        if (*dir == '/') dir++;
+    }
+
+    // Everything was removed: that is the root
+    if (length == 0) next_path.text[length++] = '/';
+    next_path.text[length] = '\0';
+    return 0;
+}
+
+// Returns the pushd/popd entry holding path, or NULL; an entry whose
+// directory was since renamed or replaced no longer holds its path
+static struct stacked_dir *find_stacked(const char *path)
+{
+    struct stat opened, named;
+
+    for (int i = dir_count - 1; i >= 0; i--)
+    {
+        if (strcmp(dir_stack[i].path.text, path) != 0) continue;
+        if (fstat(dir_stack[i].fd, &opened) || stat(path, &named)) return NULL;
+        if ((opened.st_dev != named.st_dev) || (opened.st_ino != named.st_ino)) return NULL;
+        return &dir_stack[i];
+    }
+    return NULL;
+}
+
+// Longest piece of a path handed to openat() by chdir_long(), well under
+// PATH_MAX
+#define PATH_CHUNK 2048
+
+/*
+ * chdir() to the absolute path, however long: one component group of at
+ * most PATH_CHUNK bytes at a time is opened relative to the last, and the
+ * directory reached is entered with fchdir().
+ *
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+static int chdir_long(const char *path)
+{
+    char chunk[PATH_CHUNK + 1];
+    int fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    for (path += strspn(path, "/"); (fd != -1) && *path; path += strspn(path, "/"))
+    {
+        size_t length = strlen(path);
+        int next;
+
+        // Cut at the last '/' that fits, unless one component is too long
+        if (length > PATH_CHUNK)
+        {
+            length = PATH_CHUNK;
+            while ((length > 0) && (path[length] != '/')) length--;
+            if (length == 0) length = PATH_CHUNK;
+        }
+        memcpy(chunk, path, length);
+        chunk[length] = '\0';
+        path += length;
+
+        next = openat(fd, chunk, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    if (fd == -1) return -1;
+
+    int ret = fchdir(fd);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Make next_path the current directory, and the current one the previous
+ * one. A directory on the pushd/popd stack is entered with fchdir() on its
+ * open descriptor, if the path still names it; a path too long for
+ * chdir() is followed in pieces.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int enter_path(void)
+{
+    struct stacked_dir *stacked = find_stacked(next_path.text);
+
+    if (!stacked || fchdir(stacked->fd))
+        if (chdir(next_path.text) && ((errno != ENAMETOOLONG) || chdir_long(next_path.text))) return -errno;
+
+    path_swap(&old_path, &cur_path);
+    path_swap(&cur_path, &next_path);
+    return 0;
+}
 
 /* 
  * This function needs to be called once at start-up to initialize
- * the current path. This should populate cur_path. Returns zero on
+ * the current path. This should populate cur_path. $PWD is used if it
+ * names the current directory (keeping the symlinks the user came
+ * through), otherwise the physical path from getcwd(). Returns zero on
  * success, -errno on failure.
  */
 int init_cwd(void)
 {
-    if (getcwd(cur_path, sizeof(cur_path)))
+    const char *pwd = getenv("PWD");
+    struct stat here, there;
+    char *physical;
+    int ret;
+
+    if (pwd && (pwd[0] == '/') && !stat(".", &here) && !stat(pwd, &there) && (here.st_dev == there.st_dev) &&
+        (here.st_ino == there.st_ino))
     {
-        strcpy(old_path, cur_path);
-        return 0;
+        if ((ret = resolve_path("/", pwd))) return ret;
+        path_swap(&cur_path, &next_path);
+    }
+    else
+    {
+        // getcwd() allocates a buffer as long as the path needs
+        if (!(physical = getcwd(NULL, 0))) return -errno;
+        ret = path_set(&cur_path, physical);
+        free(physical);
+        if (ret) return ret;
     }
-    return -errno;
+    return path_set(&old_path, cur_path.text);
+}
+
+// Returns the logical current directory, or NULL if it cannot be found
+const char *current_dir(void)
+{
+    if (!cur_path.text && init_cwd()) return NULL;
+    return cur_path.text;
 }
 
 // Handle a cd command.
-int handle_cd(char *args[MAX_INPUT], int stdin, int stdout)
+int handle_cd(char *args[MAX_ARGS], int stdin, int stdout)
 {
     // Note that you need to handle special arguments, including:
     // "-" switch to the last directory
@@ -35,66 +236,168 @@ int handle_cd(char *args[MAX_INPUT], int stdin, int stdout)
     //     behavior of a subsequent "cd -"
     // ".." go up one directory
     //
-    // Hint: chdir can handle "." and "..", but saving
-    //       these results may not be the desired outcome...
-    //
-    // XXX: be sure to write test cases for ., .., and weirdness
-    // XXX: test for errors in the output if a cd fails
+    // cur_path is kept up to date from the paths themselves, so no
+    // getcwd() is needed after changing directory
+    const char *dir = args[1];
+    int ret;
 
-    int retval = 0;
+    // The current path is set up lazily when thsh starts with -c
+    if (!cur_path.text && ((ret = init_cwd()))) return ret;
 
     // Handling two many arguments
-    if (args[2])
+    if (dir && args[2])
     {
         printf("Too many arguments\n");
-        return retval;
+        return 0;
     }
 
     // Handling cd (no arguments)
-    if (!args[1])
+    if (!dir && !(dir = getenv("HOME"))) return -ENOENT;
+
+    // Handling cd with arg .
+    if (strcmp(dir, ".") == 0) return path_set(&old_path, cur_path.text);
+
+    // Handling cd with arg -: the two paths just trade places
+    if (strcmp(dir, "-") == 0)
     {
-        strcpy(old_path, cur_path);
-        strcpy(cur_path, getenv("HOME"));
-        retval = chdir(cur_path);
-        return retval;
+        if ((ret = path_set(&next_path, old_path.text))) return ret;
+        return enter_path();
     }
 
-    // Handling cd with arg .
-    if (strcmp(args[1], ".") == 0)
+    // Handling regular case (including ..), if not valid path, return -errno
+    if ((ret = resolve_path(cur_path.text, dir))) return ret;
+    return enter_path();
+}
+
+// Writes all length bytes of text to fd, which may be a pipe; returns 0
+// or -errno
+int write_all(int fd, const char *text, size_t length)
+{
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t rv = write(fd, text + done, length - done);
+        if (rv < 0)
+        {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        done += rv;
+    }
+    return 0;
+}
+
+// Writes the current directory and then the pushd/popd stack, top first,
+// on one line to stdout
+static int print_dirs(int stdout)
+{
+    int ret = write_all(stdout, cur_path.text, strlen(cur_path.text));
+
+    for (int i = dir_count - 1; !ret && (i >= 0); i--)
+    {
+        const char *path = dir_stack[i].path.text;
+
+        if (!(ret = write_all(stdout, " ", 1))) ret = write_all(stdout, path, strlen(path));
+    }
+    return ret ? ret : write_all(stdout, "\n", 1);
+}
+
+// Handle a dirs command: print the directory stack
+int handle_dirs(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    int ret;
+
+    if (!cur_path.text && ((ret = init_cwd()))) return ret;
+    return print_dirs(stdout);
+}
+
+/*
+ * Handle a pushd command. "pushd DIR" pushes the current directory and
+ * changes to DIR; "pushd" alone swaps the current directory with the top
+ * of the stack. Either way, the stack is then printed as by dirs.
+ */
+int handle_pushd(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    struct stacked_dir *top;
+    int fd, ret;
+
+    if (!cur_path.text && ((ret = init_cwd()))) return ret;
+    if (args[1] && args[2])
     {
-        strcpy(old_path, cur_path);
-        return retval;
+        printf("Too many arguments\n");
+        return 0;
+    }
+    if (!args[1] && !dir_count)
+    {
+        fprintf(stderr, "pushd: no other directory\n");
+        return 1;
     }
 
-    // Handling cd with arg ..
-    if (strcmp(args[1], "..") == 0)
+    // The directory we are leaving, kept open to come back to it
+    if ((fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) return -errno;
+
+    if (!args[1])
     {
-        strcpy(old_path, cur_path);
-        retval = chdir("..");
-        if (getcwd(cur_path, sizeof(cur_path))) return retval;
-        return -errno;
+        top = &dir_stack[dir_count - 1];
+        if ((ret = path_set(&next_path, top->path.text)) || ((ret = enter_path())))
+        {
+            close(fd);
+            return ret;
+        }
+        close(top->fd);
+        top->fd = fd;
+        ret = path_set(&top->path, old_path.text);
+        return ret ? ret : print_dirs(stdout);
     }
 
-    // Handling cd with arg -
-    if (strcmp(args[1], "-") == 0)
+    if (dir_count == dir_capacity)
+    {
+        int capacity = dir_capacity ? 2 * dir_capacity : 8;
+        void *grown = realloc(dir_stack, capacity * sizeof(*dir_stack));
+
+        if (!grown)
+        {
+            close(fd);
+            return -ENOMEM;
+        }
+        dir_stack = grown;
+        for (int i = dir_capacity; i < capacity; i++) dir_stack[i] = (struct stacked_dir){{NULL, 0}, -1};
+        dir_capacity = capacity;
+    }
+    top = &dir_stack[dir_count];
+    if ((ret = path_set(&top->path, cur_path.text)) || ((ret = resolve_path(cur_path.text, args[1]))) ||
+        ((ret = enter_path())))
     {
-        char temp[MAX_INPUT];
-        strcpy(temp, cur_path);
-        strcpy(cur_path, old_path);
-        strcpy(old_path, temp);
-        retval = chdir(cur_path);
-        return retval;
+        close(fd);
+        return ret;
     }
+    top->fd = fd;
+    dir_count++;
+    return print_dirs(stdout);
+}
+
+/*
+ * Handle a popd command: remove the top of the directory stack and change
+ * to it, through its open descriptor, then print the stack.
+ */
+int handle_popd(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    struct stacked_dir *top;
+    int ret;
 
-    // Handling regular case, if not valid path, return -errno
-    retval = chdir(args[1]);
-    if (retval == 0)
+    if (!cur_path.text && ((ret = init_cwd()))) return ret;
+    if (!dir_count)
     {
-        strcpy(old_path, cur_path);
-        if (getcwd(cur_path, sizeof(cur_path)) == NULL) return -errno;
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
     }
-    else return -errno;
-    return retval;
+
+    // The path buffer stays with the entry, to be reused by the next pushd
+    top = &dir_stack[dir_count - 1];
+    if ((ret = path_set(&next_path, top->path.text)) || ((ret = enter_path()))) return ret;
+    close(top->fd);
+    top->fd = -1;
+    dir_count--;
+    return print_dirs(stdout);
 }
 
 // Handle an exit command
@@ -107,17 +410,39 @@ int handle_exit(char *args[MAX_ARGS], int stdin, int stdout)
 // Handle goheels command
 int handle_goheels(char *args[MAX_ARGS], int stdin, int stdout)
 {
-    char *ch = (char *)malloc(6000 * sizeof(char));
-    ch = "\n\n                                      ;;                                           \n                                 #╣▓╝ ╔@@@@m╖  ````                                \n                           `    ╓╥╖╦@▓╢╢▓╩╜╙,                                      \n                       ,╓╥m²` ╓▓╢╢╢╢▓╜╙                                            \n                    ╓@▓▀╙╓mⁿ @╢▓╝╙└         ▄███r                                  \n                    ╙@ ╔▓    ,╓wr       ██µ▐██            ``         `             \n            ` ,φ▓▓▓▓▓▓ └╙╜╙╙└'  ,▄⌐▐██▄▄ ██µ██▄;▄█¿     ╓╥@▓▓▓▓▓╨╨╨Mπw;  `         \n               ▓▓╜. ╙▓╣▓ç    ╓▄µ ██⌐██▌▀████¿▀▀▀▀▀└,╥@▓▓╣╣▓▄ç└╙╣╣▓w ▓æ,'           \n               ▐╣ ╓ç  ╙╣╣▓    ██µ ██ ██▄ └▀▀▀    ⁿ▓╣╣▓@╖ç╙▓╣╣╣▓▓╣╣╣▓╣╣╣@▓╗         \n            ` ▐╣ ]╢╢▓Ç └▓▄▄   ██▄,██▌ ▀▀    ▄▄████▄ ╙▓╣╣╣╣▓╣╣╣╣╣▌╙╣╣▓╚╣╣╣╣▓@╖      \n               ╣∩╢╢╢╢╕  ███▄   ▀▀▀▀▀   ;▄▄█████▄▄▄j█▄ ╙▓╣╣╣▓╙▓╣╣Γ ╟╣▌ └╣▓╙▓╣╣m `   \n             ╙▓  └└'  ╙▀███▄     ▄▄▄██████▀▀▀▀▀▀█████µ ▓╣╣▓ j╣▓╥@▓╣▓@▄░  ]╣▀╣ '    \n               ╙▓ ╙╩╝ ▄▄¿ ██████████████▀▀ ,▄▄▄▄¿▐█████▄ ╚╣Wg▓▓▀╙└└,└╙╙▀▓▓╖  ╟~    \n          ╓@▓▓@ ╙▓   ,███¿ ███████████▀.,▄██████████████▄  └└       g▓▓@╗,╙▓@.     \n           ╓▓▓╙╓▓╣▓  ; ,█U╙▀█▄ ╙,█▀▐██▀▀ ▄█████▀▀▄███████████▄   ]@  ▓╢╢╢╢▓m ▓▓    \n         ~ ▓▓ ▓▀╙;▄███ █▌ █▄ ╙████▄ └ ,▄██▀▀└,;, █████▀█████████▄▄ ╙* ╙╩╩╩╜   ▓▓   \n           ╟╣▓▓w⌠▀▀██▀ █ ▐█▌   ███████▀▀ ▄▄▀▀▀▀▌ ██████ ▀████████████▄▄  ^#@@ç ▐╣  \n          ` ╙▓╣╣╣▓ⁿ╓@g⌐▐▄▐     ▐████▄¿ ▄█▀█▄    ,███████▄ ,▀▀███▀▀▀███████▄▄ ▓╣▐╣  \n               ╙▓╗ ╫╣▓▀,▄▄▄▄▄▄███████▌ ▀█      ╓███▀▀└ ,,,,       ,,;▄▄▄███▀ ╫▓ ▓▌ \n          ╓╥R▓ç ╙╨▓╙╓▄ ▀▀██▀▀▀▀▀███████▄¿'  ;▄███▀,æ▓▓▓░╙▀╙▀▀╨w   █████▌╙ #▓╝ ╫▓   \n       ╙╨▓▓▓Nm╨╜   ▄████▄▄▄▄▄▄▄▄████████████████ /▓╨╩╜,╓@Ñ╩▓▓@w,   └▀└,╓@▓@   ▓▓   \n                ╓▄▄▄▄▄▄▄;;└▀▀▀▀████████████████▌ ╣╣╣▓@▓╙     º▓╣▓W   ╫╢╢╢▓╜ ╓▓╜    \n              ` ▐████████████▄▄▄ └▀▀████████████ ╚▓╙▓╣▌ ╬ j@╗   ╓▓▓╗  ╫╜,g▓▀  '    \n               . :▐███▄▄└▀▀▀█████▄, ╙▀██████████▄└  ▓╣W  ╩╣╢╢m  ╙╩▓▓  ╥▓▓╜  `      \n                   ▀█████▄▄▄▄▄██████▄  ▀███▀██████▄▄ ╙▀▓▓@▄╓;,,╓ ╟▓╣L              \n                  `  ╙▀███████████████▄j███∩╙██████████▄▄▄└└└└└. ╓║▓H              \n                        └▀▀██████▌,▀███████;▄███████▄▀▀▀▀,       ▓╣▓               \n                          ╓╓;  ;└└  └▀██████▀└ ,,└└╘      . '  @▓▓'                \n                         . ╙╬W╬╢╢ ,╬▓C ,;, ╓φ@╝,     `       `  └  '               \n                              ╙╙╩╬▓▓╣@#▓╩╜╙└                                       \n                                   ...                                             \n	     ______                  __    __                   __          __         \n	    /      \\                /  |  /  |                 /  |        /  |        \n	   /$$$$$$  | ______        $$ |  $$ | ______   ______ $$ | _______$$ |        \n	   $$ | _$$/ /      \\       $$ |__$$ |/      \\ /      \\$$ |/       $$ |        \n	   $$ |/    /$$$$$$  |      $$    $$ /$$$$$$  /$$$$$$  $$ /$$$$$$$/$$ |        \n	   $$ |$$$$ $$ |  $$ |      $$$$$$$$ $$    $$ $$    $$ $$ $$      \\$$/         \n	   $$ \\__$$ $$ \\__$$ |      $$ |  $$ $$$$$$$$/$$$$$$$$/$$ |$$$$$$  |__         \n	   $$    $$/$$    $$/       $$ |  $$ $$       $$       $$ /     $$//  |        \n 	    $$$$$$/  $$$$$$/        $$/   $$/ $$$$$$$/ $$$$$$$/$$/$$$$$$$/ $$/         \n\n\n\0";
+    // The art is a string literal, so there is nothing to allocate or free
+    const char *ch = "\n\n                                      ;;                                           \n                                 #╣▓╝ ╔@@@@m╖  ````                                \n                           `    ╓╥╖╦@▓╢╢▓╩╜╙,                                      \n                       ,╓╥m²` ╓▓╢╢╢╢▓╜╙                                            \n                    ╓@▓▀╙╓mⁿ @╢▓╝╙└         ▄███r                                  \n                    ╙@ ╔▓    ,╓wr       ██µ▐██            ``         `             \n            ` ,φ▓▓▓▓▓▓ └╙╜╙╙└'  ,▄⌐▐██▄▄ ██µ██▄;▄█¿     ╓╥@▓▓▓▓▓╨╨╨Mπw;  `         \n               ▓▓╜. ╙▓╣▓ç    ╓▄µ ██⌐██▌▀████¿▀▀▀▀▀└,╥@▓▓╣╣▓▄ç└╙╣╣▓w ▓æ,'           \n               ▐╣ ╓ç  ╙╣╣▓    ██µ ██ ██▄ └▀▀▀    ⁿ▓╣╣▓@╖ç╙▓╣╣╣▓▓╣╣╣▓╣╣╣@▓╗         \n            ` ▐╣ ]╢╢▓Ç └▓▄▄   ██▄,██▌ ▀▀    ▄▄████▄ ╙▓╣╣╣╣▓╣╣╣╣╣▌╙╣╣▓╚╣╣╣╣▓@╖      \n               ╣∩╢╢╢╢╕  ███▄   ▀▀▀▀▀   ;▄▄█████▄▄▄j█▄ ╙▓╣╣╣▓╙▓╣╣Γ ╟╣▌ └╣▓╙▓╣╣m `   \n             ╙▓  └└'  ╙▀███▄     ▄▄▄██████▀▀▀▀▀▀█████µ ▓╣╣▓ j╣▓╥@▓╣▓@▄░  ]╣▀╣ '    \n               ╙▓ ╙╩╝ ▄▄¿ ██████████████▀▀ ,▄▄▄▄¿▐█████▄ ╚╣Wg▓▓▀╙└└,└╙╙▀▓▓╖  ╟~    \n          ╓@▓▓@ ╙▓   ,███¿ ███████████▀.,▄██████████████▄  └└       g▓▓@╗,╙▓@.     \n           ╓▓▓╙╓▓╣▓  ; ,█U╙▀█▄ ╙,█▀▐██▀▀ ▄█████▀▀▄███████████▄   ]@  ▓╢╢╢╢▓m ▓▓    \n         ~ ▓▓ ▓▀╙;▄███ █▌ █▄ ╙████▄ └ ,▄██▀▀└,;, █████▀█████████▄▄ ╙* ╙╩╩╩╜   ▓▓   \n           ╟╣▓▓w⌠▀▀██▀ █ ▐█▌   ███████▀▀ ▄▄▀▀▀▀▌ ██████ ▀████████████▄▄  ^#@@ç ▐╣  \n          ` ╙▓╣╣╣▓ⁿ╓@g⌐▐▄▐     ▐████▄¿ ▄█▀█▄    ,███████▄ ,▀▀███▀▀▀███████▄▄ ▓╣▐╣  \n               ╙▓╗ ╫╣▓▀,▄▄▄▄▄▄███████▌ ▀█      ╓███▀▀└ ,,,,       ,,;▄▄▄███▀ ╫▓ ▓▌ \n          ╓╥R▓ç ╙╨▓╙╓▄ ▀▀██▀▀▀▀▀███████▄¿'  ;▄███▀,æ▓▓▓░╙▀╙▀▀╨w   █████▌╙ #▓╝ ╫▓   \n       ╙╨▓▓▓Nm╨╜   ▄████▄▄▄▄▄▄▄▄████████████████ /▓╨╩╜,╓@Ñ╩▓▓@w,   └▀└,╓@▓@   ▓▓   \n                ╓▄▄▄▄▄▄▄;;└▀▀▀▀████████████████▌ ╣╣╣▓@▓╙     º▓╣▓W   ╫╢╢╢▓╜ ╓▓╜    \n              ` ▐████████████▄▄▄ └▀▀████████████ ╚▓╙▓╣▌ ╬ j@╗   ╓▓▓╗  ╫╜,g▓▀  '    \n               . :▐███▄▄└▀▀▀█████▄, ╙▀██████████▄└  ▓╣W  ╩╣╢╢m  ╙╩▓▓  ╥▓▓╜  `      \n                   ▀█████▄▄▄▄▄██████▄  ▀███▀██████▄▄ ╙▀▓▓@▄╓;,,╓ ╟▓╣L              \n                  `  ╙▀███████████████▄j███∩╙██████████▄▄▄└└└└└. ╓║▓H              \n                        └▀▀██████▌,▀███████;▄███████▄▀▀▀▀,       ▓╣▓               \n                          ╓╓;  ;└└  └▀██████▀└ ,,└└╘      . '  @▓▓'                \n                         . ╙╬W╬╢╢ ,╬▓C ,;, ╓φ@╝,     `       `  └  '               \n                              ╙╙╩╬▓▓╣@#▓╩╜╙└                                       \n                                   ...                                             \n	     ______                  __    __                   __          __         \n	    /      \\                /  |  /  |                 /  |        /  |        \n	   /$$$$$$  | ______        $$ |  $$ | ______   ______ $$ | _______$$ |        \n	   $$ | _$$/ /      \\       $$ |__$$ |/      \\ /      \\$$ |/       $$ |        \n	   $$ |/    /$$$$$$  |      $$    $$ /$$$$$$  /$$$$$$  $$ /$$$$$$$/$$ |        \n	   $$ |$$$$ $$ |  $$ |      $$$$$$$$ $$    $$ $$    $$ $$ $$      \\$$/         \n	   $$ \\__$$ $$ \\__$$ |      $$ |  $$ $$$$$$$$/$$$$$$$$/$$ |$$$$$$  |__         \n	   $$    $$/$$    $$/       $$ |  $$ $$       $$       $$ /     $$//  |        \n 	    $$$$$$/  $$$$$$/        $$/   $$/ $$$$$$$/ $$$$$$$/$$/$$$$$$$/ $$/         \n\n\n\0";
 
-    write(stdout, ch, strlen(ch));
-    return 0;
+    // stdout may be a pipe, so keep writing until all of it is out
+    return write_all(stdout, ch, strlen(ch));
 }
 
-static struct builtin builtins[] = {{"cd", handle_cd},
-                                    {"exit", handle_exit},
-                                    {"goheels", handle_goheels},
-                                    {'\0', NULL}};
+static struct builtin builtins[] = {{"cd", handle_cd, BUILTIN_STATEFUL},
+                                    {"pushd", handle_pushd, BUILTIN_STATEFUL},
+                                    {"popd", handle_popd, BUILTIN_STATEFUL},
+                                    {"dirs", handle_dirs, BUILTIN_PURE},
+                                    {"exit", handle_exit, BUILTIN_STATEFUL},
+                                    {"goheels", handle_goheels, BUILTIN_PURE},
+                                    {"cache", handle_cache, BUILTIN_STATEFUL},
+                                    {"source", handle_source, BUILTIN_STATEFUL},
+                                    {"stats", handle_stats, BUILTIN_PURE},
+                                    {'\0', NULL, BUILTIN_NONE}};
+
+/* 
+ * This function checks if the command (args[0]) is a built-in, and if
+ * so, whether running it can change the state of the shell.
+ *
+ * Returns BUILTIN_NONE if args[0] is not a builtin, BUILTIN_PURE if the
+ * builtin only reads stdin and writes stdout (so it can safely run on a
+ * thread next to the shell), or BUILTIN_STATEFUL if it changes the shell
+ * itself (e.g., its current directory).
+ */
+int builtin_kind(char *args[MAX_ARGS])
+{
+    for (int i = 0; builtins[i].cmd; i++)
+        if (strcmp(args[0], builtins[i].cmd) == 0) return builtins[i].kind;
+    return BUILTIN_NONE;
+}
 
 /* 
  * This function checks if the command (args[0]) is a built-in. If so,
@@ -126,7 +451,8 @@ static struct builtin builtins[] = {{"cd", handle_cd},
  * stdin and stdout are the file handles for standard in and standard out,
  * respectively. These may or may not be used by individual builtin commands.
  *
- * Places the return value of the command in *retval.
+ * Places the return value of the command in *retval: -errno if the
+ * command failed to run, otherwise its exit status (normally 0).
  *
  * stdin and stdout should not be closed by this command.
  *
@@ -134,23 +460,15 @@ static struct builtin builtins[] = {{"cd", handle_cd},
  */
 int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval)
 {
-    int rv = 0;
-
-    if (strcmp(args[0], builtins[0].cmd) == 0) // cmd == cd
+    for (int i = 0; builtins[i].cmd; i++)
     {
-        *retval = handle_cd(&args[0], stdin, stdout);
-        return 1;
-    }
-    else if (strcmp(args[0], builtins[1].cmd) == 0) // cmd == exit
-    {
-        *retval = handle_exit(&args[0], stdin, stdout);
-    }
-    else if (strcmp(args[0], builtins[2].cmd) == 0) // cmd == goheels
-    {
-        *retval = handle_goheels(&args[0], stdin, stdout);
-        return 1;
+        if (strcmp(args[0], builtins[i].cmd) == 0)
+        {
+            *retval = builtins[i].func(&args[0], stdin, stdout);
+            return 1;
+        }
     }
-    return rv;
+    return 0;
 }
 
 /* 
@@ -172,11 +490,10 @@ int print_prompt(void)
     // print the whole prompt string (write number of
     // bytes/chars equal to the length of prompt)
     const char *prompt = "thsh> ";
+    struct iovec parts[] = {{"[", 1}, {cur_path.text, strlen(cur_path.text)}, {"] ", 2},
+                            {(char *)prompt, strlen(prompt)}};
 
-    write(1, "[", strlen("["));
-    write(1, cur_path, strlen(cur_path));
-    write(1, "] ", strlen("] "));
-
-    ret = write(1, prompt, strlen(prompt));
+    // One system call for the whole prompt
+    ret = writev(1, parts, sizeof(parts) / sizeof(parts[0]));
     return ret;
 }
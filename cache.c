@@ -0,0 +1,392 @@
+/*
+ * This file implements the "cache" builtin, which memoizes the output of
+ * deterministic commands:
+ *
+ *     cache [--content] [--inputs FILE... --] command [args...]
+ *
+ * The command is identified by a key hashed from its argv, the current
+ * (logical) directory, selected environment variables (PATH, plus the names listed
+ * in THSH_CACHE_ENV, separated by ':'), and the identity of its inputs:
+ * the declared input files and stdin. An input's identity is its device,
+ * inode, mtime and size, or a hash of its contents with --content.
+ *
+ * On a hit, the stored stdout and exit status are replayed and the command
+ * does not run. On a miss, it runs with its stdout captured into the
+ * store, which is then replayed. A command whose stdin is not a regular
+ * file (or /dev/null) always runs, since a pipe or a terminal cannot be
+ * identified. Builtins that change the shell (cd, exit, source...) and
+ * functions cannot be cached.
+ *
+ * The store is a directory ($THSH_CACHE_DIR, or thsh/ under
+ * $XDG_CACHE_HOME or ~/.cache) holding one file per key: a fixed-size
+ * header with the exit status, followed by the output. Reading an entry
+ * bumps its mtime, and once the store grows past THSH_CACHE_SIZE bytes
+ * (64 MiB by default), entries are evicted in least recently used order.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+// <dirent.h> pulls in the terminal MAX_INPUT from <limits.h>; use ours
+#undef MAX_INPUT
+#include "thsh.h"
+
+// Default bound on the total size of the store
+#define CACHE_DEFAULT_SIZE (64L * 1024 * 1024)
+
+// Every entry starts with this header, exit status included (fixed size)
+#define CACHE_HEADER "thsh-cache 1 %03d\n"
+#define CACHE_HEADER_SIZE 17
+
+// Two independent 64-bit FNV-1a hashes, giving a 128-bit key
+struct cache_key
+{
+    uint64_t h[2];
+};
+
+static void key_add(struct cache_key *key, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        key->h[0] = (key->h[0] ^ bytes[i]) * 0x100000001b3ULL;
+        key->h[1] = (key->h[1] ^ bytes[i]) * 0x100000001b3ULL;
+    }
+}
+
+// Adds a string, including its terminator so "ab","c" differs from "a","bc"
+static void key_add_string(struct cache_key *key, const char *str)
+{
+    key_add(key, str, strlen(str) + 1);
+}
+
+// Adds an environment variable, or a marker if it is not set
+static void key_add_env(struct cache_key *key, const char *name)
+{
+    char *value = getenv(name);
+
+    key_add_string(key, name);
+    key_add_string(key, value ? value : "\001unset");
+}
+
+/*
+ * Adds the identity of the open file fd: its device, inode, mtime and
+ * size, or, if content is true, all of its bytes.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int key_add_file(struct cache_key *key, int fd, bool content)
+{
+    struct stat st;
+
+    if (fstat(fd, &st)) return -errno;
+
+    if (!content)
+    {
+        key_add(key, &st.st_dev, sizeof(st.st_dev));
+        key_add(key, &st.st_ino, sizeof(st.st_ino));
+        key_add(key, &st.st_mtim, sizeof(st.st_mtim));
+        key_add(key, &st.st_size, sizeof(st.st_size));
+        return 0;
+    }
+
+    char buf[16384];
+    off_t offset = 0;
+    ssize_t rv;
+
+    while ((rv = pread(fd, buf, sizeof(buf), offset)) > 0)
+    {
+        key_add(key, buf, rv);
+        offset += rv;
+    }
+    return (rv < 0) ? -errno : 0;
+}
+
+/*
+ * Writes the store's directory into dir (size bytes), creating it if
+ * needed. Returns 0 on success, -errno on failure.
+ */
+static int cache_dir(char *dir, size_t size)
+{
+    char *base = getenv("THSH_CACHE_DIR");
+    int length;
+
+    if (base) length = snprintf(dir, size, "%s", base);
+    else if (getenv("XDG_CACHE_HOME")) length = snprintf(dir, size, "%s/thsh", getenv("XDG_CACHE_HOME"));
+    else if (getenv("HOME")) length = snprintf(dir, size, "%s/.cache/thsh", getenv("HOME"));
+    else return -ENOENT;
+    if (length >= size) return -ENAMETOOLONG;
+
+    // mkdir -p, one component at a time
+    for (char *slash = strchr(dir + 1, '/');; slash = strchr(slash + 1, '/'))
+    {
+        if (slash) *slash = '\0';
+        if (mkdir(dir, S_IRWXU) && (errno != EEXIST)) return -errno;
+        if (!slash) break;
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Copies fd, from offset to its end, to stdout; returns 0 or -errno
+static int replay(int fd, off_t offset, int stdout)
+{
+    char buf[16384];
+    ssize_t rv;
+
+    while ((rv = pread(fd, buf, sizeof(buf), offset)) > 0)
+    {
+        int ret = write_all(stdout, buf, rv);
+        if (ret) return ret;
+        offset += rv;
+    }
+    return (rv < 0) ? -errno : 0;
+}
+
+// An entry of the store, as seen by cache_evict()
+struct cache_entry
+{
+    char name[64];
+    struct timespec mtime;
+    off_t size;
+};
+
+static int older_first(const void *a, const void *b)
+{
+    const struct cache_entry *x = a, *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return (x->mtime.tv_sec < y->mtime.tv_sec) ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) return (x->mtime.tv_nsec < y->mtime.tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Bring the store in dir back under THSH_CACHE_SIZE bytes, removing the
+ * least recently used entries (oldest mtime) first.
+ */
+static void cache_evict(const char *dir)
+{
+    long limit = getenv("THSH_CACHE_SIZE") ? atol(getenv("THSH_CACHE_SIZE")) : CACHE_DEFAULT_SIZE;
+    struct cache_entry *entries = NULL;
+    int count = 0, capacity = 0;
+    long total = 0;
+    struct dirent *dirent;
+    DIR *d = opendir(dir);
+
+    if (!d) return;
+    while ((dirent = readdir(d)))
+    {
+        struct stat st;
+
+        // Entries are named after their 32 hex digit key; skip temporaries
+        if ((strlen(dirent->d_name) != 32) || fstatat(dirfd(d), dirent->d_name, &st, 0)) continue;
+
+        if (count == capacity)
+        {
+            struct cache_entry *grown;
+            capacity = capacity ? 2 * capacity : 64;
+            grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, dirent->d_name);
+        entries[count].mtime = st.st_mtim;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > limit)
+    {
+        qsort(entries, count, sizeof(*entries), older_first);
+        for (int i = 0; (i < count) && (total > limit); i++)
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0) total -= entries[i].size;
+    }
+    closedir(d);
+    free(entries);
+}
+
+// The command run_uncached() is waiting for, and a signal that arrived
+// before it was started
+static volatile sig_atomic_t uncached_pid = 0;
+static volatile sig_atomic_t uncached_signal = 0;
+
+// Passes SIGTERM (e.g., from a timeout) on to the command being run, so
+// it stops, and its status keeps the partial output out of the store
+static void forward_signal(int sig)
+{
+    if (uncached_pid > 0) kill(uncached_pid, sig);
+    else uncached_signal = sig;
+}
+
+// Whether command is a builtin that changes the shell, or a function
+static bool changes_shell(char **command)
+{
+    return (builtin_kind(command) == BUILTIN_STATEFUL) || function_defined(command[0]);
+}
+
+/*
+ * Runs command (a pure builtin or an external command) on stdin and
+ * stdout and waits for it, through wait_child(), which holds it to the
+ * deadline of cache itself. A SIGTERM meanwhile is passed on to it.
+ * Returns its exit status, or -errno if it could not be started.
+ */
+static int run_uncached(char **command, int stdin, int stdout)
+{
+    int status = 0, wstatus, ret = 0;
+
+    if (builtin_kind(command) != BUILTIN_NONE)
+    {
+        handle_builtin(command, stdin, stdout, &status);
+        return status;
+    }
+
+    struct sigaction forward = {.sa_handler = forward_signal}, saved;
+
+    uncached_signal = 0;
+    sigaction(SIGTERM, &forward, &saved);
+    int pid = spawn_command(command, stdin, stdout, -1, -1, NULL);
+    if (pid > 0)
+    {
+        uncached_pid = pid;
+        if (uncached_signal) kill(pid, uncached_signal);
+        ret = wait_child(pid, command[0], &wstatus);
+    }
+    uncached_pid = 0;
+    sigaction(SIGTERM, &saved, NULL);
+
+    if (pid < 0) return pid;
+    return ret ? ret : exit_status(wstatus);
+}
+
+// Handle a cache command
+int handle_cache(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    struct cache_key key = {{0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL}};
+    char dir[MAX_INPUT], path[MAX_INPUT + 64], tmp[MAX_INPUT + 72];
+    char header[CACHE_HEADER_SIZE + 1];
+    const char *cwd = current_dir();
+    bool content = false;
+    struct stat st;
+    char **inputs = NULL;
+    int ninputs = 0;
+    int ret, fd, status = 0;
+    int i = 1;
+
+    // Parse the options; inputs are the words between --inputs and --
+    for (; args[i] && (strncmp(args[i], "--", 2) == 0); i++)
+    {
+        if (strcmp(args[i], "--content") == 0) content = true;
+        else if (strcmp(args[i], "--inputs") == 0)
+        {
+            inputs = &args[i + 1];
+            for (i++; args[i] && strcmp(args[i], "--"); i++) ninputs++;
+            if (!args[i]) break;
+        }
+        else break;
+    }
+    if (!args[i] || (strncmp(args[i], "--", 2) == 0))
+    {
+        printf("cache: usage: cache [--content] [--inputs FILE... --] command [args...]\n");
+        return -EINVAL;
+    }
+
+    // The wrapped command, as a whole argv of its own
+    char *command[MAX_ARGS] = {NULL};
+    for (int k = 0; args[i + k]; k++) command[k] = args[i + k];
+
+    // Its output is all that is replayed, so the command must not change
+    // the shell; cache itself runs in the shell when it is on its own
+    if (changes_shell(command))
+    {
+        printf("cache: %s: cannot cache a command that changes the shell\n", command[0]);
+        return -EINVAL;
+    }
+
+    // Only a regular file on stdin can be identified (/dev/null needs no
+    // identity), and so must the directory; otherwise just run the command
+    if (fstat(stdin, &st)) st.st_mode = 0;
+    if (!(S_ISREG(st.st_mode) || (S_ISCHR(st.st_mode) && (st.st_rdev == makedev(1, 3)))) || !cwd)
+        return run_uncached(command, stdin, stdout);
+
+    for (int k = 0; command[k]; k++) key_add_string(&key, command[k]);
+    key_add_string(&key, cwd);
+    key_add_env(&key, "PATH");
+    if (getenv("THSH_CACHE_ENV"))
+    {
+        char names[MAX_INPUT];
+        char *addr = NULL;
+
+        // Leaving out a variable could replay the wrong output
+        if (snprintf(names, sizeof(names), "%s", getenv("THSH_CACHE_ENV")) >= sizeof(names))
+            return run_uncached(command, stdin, stdout);
+        for (char *name = strtok_r(names, ":", &addr); name; name = strtok_r(NULL, ":", &addr))
+            key_add_env(&key, name);
+    }
+    for (int k = 0; k < ninputs; k++)
+    {
+        key_add_string(&key, inputs[k]);
+        fd = open(inputs[k], O_RDONLY | O_CLOEXEC);
+        ret = (fd == -1) ? -errno : key_add_file(&key, fd, content);
+        if (fd != -1) close(fd);
+        if (ret)
+        {
+            printf("cache: %s: %s\n", inputs[k], strerror(-ret));
+            return ret;
+        }
+    }
+    if (S_ISREG(st.st_mode) && (ret = key_add_file(&key, stdin, content))) return ret;
+
+    if (cache_dir(dir, sizeof(dir))) return run_uncached(command, stdin, stdout);
+    if (snprintf(path, sizeof(path), "%s/%016lx%016lx", dir, (unsigned long)key.h[0], (unsigned long)key.h[1]) >=
+        sizeof(path))
+        return run_uncached(command, stdin, stdout);
+
+    // Hit: replay the stored output and status, and mark the entry as used
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        if ((pread(fd, header, CACHE_HEADER_SIZE, 0) == CACHE_HEADER_SIZE) &&
+            (sscanf(header, CACHE_HEADER, &status) == 1))
+        {
+            futimens(fd, NULL);
+            ret = replay(fd, CACHE_HEADER_SIZE, stdout);
+            close(fd);
+            return ret ? ret : status;
+        }
+        close(fd);
+    }
+
+    // Miss: run the command with its output captured into a new entry
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) return run_uncached(command, stdin, stdout);
+    fd = mkstemp(tmp);
+    if (fd == -1) return run_uncached(command, stdin, stdout);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    snprintf(header, sizeof(header), CACHE_HEADER, 0);
+    if (write(fd, header, CACHE_HEADER_SIZE) != CACHE_HEADER_SIZE)
+    {
+        unlink(tmp);
+        close(fd);
+        return run_uncached(command, stdin, stdout);
+    }
+
+    status = run_uncached(command, stdin, fd);
+    ret = (status < 0) ? status : replay(fd, CACHE_HEADER_SIZE, stdout);
+
+    // Only remember commands that ran to completion (not killed by a signal)
+    snprintf(header, sizeof(header), CACHE_HEADER, status & 0xff);
+    if (ret || (status >= 128) || (pwrite(fd, header, CACHE_HEADER_SIZE, 0) != CACHE_HEADER_SIZE) ||
+        rename(tmp, path))
+        unlink(tmp);
+    close(fd);
+    cache_evict(dir);
+    return ret ? ret : status;
+}
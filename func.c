@@ -0,0 +1,605 @@
+/*
+ * This file implements shell functions and the "source" builtin.
+ *
+ * A function is defined with
+ *
+ *     name() {
+ *         command | command ...
+ *     }
+ *
+ * or on one line, as "name() { command ... }". Calling it runs its body in
+ * the shell, where the words $0 to $9 stand for the call's arguments ($0 is
+ * the name); a parameter that was not passed is dropped.
+ *
+ * Bodies, sourced files and -c strings are all parsed once into a script:
+ * every line is tokenized with parse_line() when the script is built and
+ * kept with its stages, so running a function in a loop, or sourcing the
+ * same library from every script, does not read or parse it again. Sourced
+ * files are cached by device and inode, and re-read only when their mtime
+ * or size changes.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "thsh.h"
+
+// Number of buckets in the function table
+#define FUNCTION_BUCKETS 64
+
+// One line of a script, parsed once
+struct script_line
+{
+    struct command_table table; // its stages
+    int steps;                  // stages in table, 0 for an empty line, -errno if it did not parse
+    char *infile, *outfile;
+    bool has_params;            // some word (or file name) is $0 to $9
+    char *name;                 // if the line defines a function: its name...
+    struct script *body;        // ...and body
+};
+
+// A parsed sequence of lines: a function body, a sourced file or a -c string
+struct script
+{
+    struct script_line *lines;
+    int count, capacity;
+};
+
+struct function
+{
+    char *name;
+    struct script *body;
+    struct function *next; // in the same bucket
+};
+
+// A sourced file, as it was when it was last parsed
+struct sourced_file
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    struct script *script;
+    struct sourced_file *next;
+};
+
+static struct function *functions[FUNCTION_BUCKETS];
+static int function_count = 0;
+static struct sourced_file *sourced_files = NULL;
+
+// Scratch stages for lines with parameters, one table per call depth
+static struct command_table scratch[MAX_CALL_DEPTH + 1];
+static int call_depth = 0;
+
+static int script_build(struct script *script, char **cursor, bool body);
+
+// Returns the bucket of the function called name
+static unsigned int function_bucket(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash % FUNCTION_BUCKETS;
+}
+
+// Returns the body of the function called name, or NULL if there is none
+static struct script *function_find(const char *name)
+{
+    if (!function_count || !name) return NULL;
+    for (struct function *f = functions[function_bucket(name)]; f; f = f->next)
+        if (strcmp(f->name, name) == 0) return f->body;
+    return NULL;
+}
+
+/*
+ * Define (or redefine) the function called name. A replaced body is not
+ * freed, since it may be running right now.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int function_define(char *name, struct script *body)
+{
+    unsigned int bucket = function_bucket(name);
+    struct function *f;
+
+    for (f = functions[bucket]; f; f = f->next)
+    {
+        if (strcmp(f->name, name) == 0)
+        {
+            f->body = body;
+            return 0;
+        }
+    }
+
+    f = malloc(sizeof(*f));
+    if (!f) return -ENOMEM;
+    *f = (struct function){.name = name, .body = body, .next = functions[bucket]};
+    functions[bucket] = f;
+    function_count++;
+    return 0;
+}
+
+// Returns true if the function called name is defined
+bool function_defined(const char *name)
+{
+    return function_find(name) != NULL;
+}
+
+static char *skip_spaces(const char *text)
+{
+    while ((*text == ' ') || (*text == '\t')) text++;
+    return (char *)text;
+}
+
+/*
+ * If line starts a function definition ("name() {"), returns the length
+ * of the name (which starts at *name) and points *rest at whatever follows
+ * the '{'. Returns 0 otherwise. line is not changed.
+ */
+static int definition_header(const char *line, char **name, char **rest)
+{
+    const char *start = skip_spaces(line);
+    const char *end = start;
+    const char *cursor;
+
+    while ((*end == '_') || (*end == '-') || (*end == '.') || ((*end >= 'a') && (*end <= 'z')) ||
+           ((*end >= 'A') && (*end <= 'Z')) || ((*end >= '0') && (*end <= '9')))
+        end++;
+    if (end == start) return 0;
+
+    cursor = skip_spaces(end);
+    if ((cursor[0] != '(') || (cursor[1] != ')')) return 0;
+    cursor = skip_spaces(cursor + 2);
+    if (*cursor != '{') return 0;
+
+    *name = (char *)start;
+    *rest = skip_spaces(cursor + 1);
+    return end - start;
+}
+
+// Returns true if line starts a definition whose body is on the next lines
+static bool opens_body(const char *line)
+{
+    char *name, *rest;
+
+    return definition_header(line, &name, &rest) && ((*rest == '\0') || (*rest == '\n') || (*rest == '#'));
+}
+
+// Returns true if line closes a function body ("}", maybe with a comment)
+static bool closes_body(const char *line)
+{
+    line = skip_spaces(line);
+    if (*line != '}') return false;
+    line = skip_spaces(line + 1);
+    return (*line == '\0') || (*line == '\n') || (*line == '#');
+}
+
+// Returns true if line starts a function definition
+bool definition_start(const char *line)
+{
+    char *name, *rest;
+
+    return definition_header(line, &name, &rest) != 0;
+}
+
+// Returns true if word is one of $0 to $9
+static bool is_param(const char *word)
+{
+    return word && (word[0] == '$') && (word[1] >= '0') && (word[1] <= '9') && !word[2];
+}
+
+// Appends an empty line to script; returns it, or NULL if out of memory
+static struct script_line *add_line(struct script *script)
+{
+    if (script->count == script->capacity)
+    {
+        int capacity = script->capacity ? 2 * script->capacity : 16;
+        struct script_line *grown = realloc(script->lines, capacity * sizeof(*grown));
+        if (!grown) return NULL;
+        script->lines = grown;
+        script->capacity = capacity;
+    }
+    script->lines[script->count] = (struct script_line){0};
+    return &script->lines[script->count++];
+}
+
+// Parses line (already cut at its end) into entry
+static void parse_entry(struct script_line *entry, char *line)
+{
+    long start = stats_now();
+
+    entry->steps = parse_line(line, strlen(line), &entry->table, &entry->infile, &entry->outfile);
+    stats_add(STAT_PARSE_NS, stats_now() - start);
+    stats_add(STAT_LINES_PARSED, 1);
+
+    entry->has_params = is_param(entry->infile) || is_param(entry->outfile);
+    for (int i = 0; i < entry->steps; i++)
+        for (int j = 0; entry->table.commands[i][j]; j++)
+            if (is_param(entry->table.commands[i][j])) entry->has_params = true;
+}
+
+/*
+ * Parse the lines of text at *cursor into script, in place: the text is
+ * tokenized, and must outlive the script. If body is true, stop after the
+ * line that closes the body ("}"). *cursor is left after the last line
+ * used.
+ *
+ * Returns 0 on success, -errno on failure (-EINVAL for a body that is
+ * not closed).
+ */
+static int script_build(struct script *script, char **cursor, bool body)
+{
+    while (**cursor)
+    {
+        char *line = *cursor;
+        char *newline = strchr(line, '\n');
+        struct script_line *entry;
+        char *name, *rest;
+        int length;
+
+        if (newline)
+        {
+            *newline = '\0';
+            *cursor = newline + 1;
+        }
+        else *cursor = line + strlen(line);
+
+        if (body && closes_body(line)) return 0;
+        if (!(entry = add_line(script))) return -ENOMEM;
+
+        length = definition_header(line, &name, &rest);
+        if (!length)
+        {
+            parse_entry(entry, line);
+            continue;
+        }
+
+        // A function definition: its body is a script of its own
+        name[length] = '\0';
+        entry->name = name;
+        if (!(entry->body = calloc(1, sizeof(struct script)))) return -ENOMEM;
+
+        if ((*rest == '\0') || (*rest == '#'))
+        {
+            int ret = script_build(entry->body, cursor, true);
+            if (ret) return ret;
+            continue;
+        }
+
+        // "name() { command ... }" on one line
+        char *end = rest + strlen(rest);
+        while ((end > rest) && ((end[-1] == ' ') || (end[-1] == '\t'))) end--;
+        if ((end == rest) || (end[-1] != '}')) return -EINVAL;
+        end[-1] = '\0';
+        if (!(entry = add_line(entry->body))) return -ENOMEM;
+        parse_entry(entry, rest);
+    }
+    return body ? -EINVAL : 0;
+}
+
+/*
+ * Parse text (tokenized in place; it must outlive the result) into a new
+ * script.
+ *
+ * Returns the script, or NULL on failure, with errno set.
+ */
+static struct script *script_parse(char *text)
+{
+    struct script *script = calloc(1, sizeof(*script));
+    int ret;
+
+    if (!script) return NULL;
+    if ((ret = script_build(script, &text, false)))
+    {
+        errno = -ret;
+        return NULL;
+    }
+    return script;
+}
+
+/*
+ * Returns the stages of entry with $0 to $9 replaced by params (a NULL
+ * terminated argument list), or NULL if out of memory. The result is only
+ * valid until the next call at the same call depth.
+ */
+static char *(*substitute(struct script_line *entry, char **params, char **infile, char **outfile))[MAX_ARGS]
+{
+    struct command_table *table = &scratch[call_depth];
+    int count = 0;
+
+    while (params[count]) count++;
+
+    if (table->capacity < entry->steps + 1)
+    {
+        char *(*grown)[MAX_ARGS] = realloc(table->commands, (entry->steps + 1) * sizeof(*grown));
+        if (!grown) return NULL;
+        table->commands = grown;
+        table->capacity = entry->steps + 1;
+    }
+
+    for (int i = 0; i <= entry->steps; i++)
+    {
+        int k = 0;
+
+        for (int j = 0; entry->table.commands[i][j]; j++)
+        {
+            char *word = entry->table.commands[i][j];
+            if (!is_param(word)) table->commands[i][k++] = word;
+            else if (word[1] - '0' < count) table->commands[i][k++] = params[word[1] - '0'];
+        }
+        table->commands[i][k] = NULL;
+    }
+
+    if (is_param(*infile)) *infile = ((*infile)[1] - '0' < count) ? params[(*infile)[1] - '0'] : NULL;
+    if (is_param(*outfile)) *outfile = ((*outfile)[1] - '0' < count) ? params[(*outfile)[1] - '0'] : NULL;
+    return table->commands;
+}
+
+/*
+ * Run every line of script in the shell, defining its functions as they
+ * come. If params is not NULL, it is the argument list $0 to $9 stand
+ * for. If exec_last is true, the last stage of the last line is exec'd in
+ * place of the shell (see run_pipeline()).
+ *
+ * Returns the exit status of the last pipeline, or 127 if it could not be
+ * started.
+ */
+static int script_run(struct script *script, char **params, bool exec_last)
+{
+    int result = 0;
+
+    for (int k = 0; k < script->count; k++)
+    {
+        struct script_line *entry = &script->lines[k];
+        char *(*commands)[MAX_ARGS] = entry->table.commands;
+        char *infile = entry->infile;
+        char *outfile = entry->outfile;
+        int ret, status = 0;
+
+        if (entry->body)
+        {
+            if ((ret = function_define(entry->name, entry->body))) printf("Failed to run command - error %d\n", ret);
+            continue;
+        }
+        if (!entry->steps) continue;
+        if (entry->steps < 0)
+        {
+            printf("Parsing error. Cannot execute command. %d\n", -entry->steps);
+            result = 127;
+            continue;
+        }
+
+        if (params && entry->has_params && !(commands = substitute(entry, params, &infile, &outfile)))
+            ret = -ENOMEM;
+        else ret = run_pipeline(commands, entry->steps, infile, outfile, exec_last && (k == script->count - 1),
+                                &status);
+
+        // Do not change this if/printf
+        if (ret) printf("Failed to run command - error %d\n", ret);
+        result = ret ? 127 : exit_status(status);
+    }
+    return result;
+}
+
+/*
+ * Call the function named by args[0] with args as its parameters, in the
+ * shell. If exec_last is true, its last stage may replace the shell.
+ *
+ * Stores a wait()-style status of its last pipeline in *status. Returns 0
+ * on success, -ENOENT if there is no such function, or -ELOOP if calls
+ * nest more than MAX_CALL_DEPTH deep.
+ */
+int run_function(char *args[MAX_ARGS], bool exec_last, int *status)
+{
+    struct script *body = function_find(args[0]);
+
+    if (!body) return -ENOENT;
+    if (call_depth == MAX_CALL_DEPTH) return -ELOOP;
+
+    stats_add(STAT_FUNCTIONS, 1);
+    call_depth++;
+    *status = W_EXITCODE(script_run(body, args, exec_last) & 0xff, 0);
+    call_depth--;
+    return 0;
+}
+
+/*
+ * Parse and run every line of commands (separated by '\n') in the shell,
+ * as the interactive loop would. commands is modified in place, and must
+ * outlive the functions it defines.
+ *
+ * If exec_last is true, the last stage of the last line is exec'd in place
+ * of the shell (see run_pipeline()).
+ *
+ * Returns the exit status of the last pipeline, or 127 if it could not be
+ * started.
+ */
+int run_string(char *commands, bool exec_last)
+{
+    struct script *script = script_parse(commands);
+
+    if (!script)
+    {
+        printf("Parsing error. Cannot execute command. %d\n", errno);
+        return 127;
+    }
+    return script_run(script, NULL, exec_last);
+}
+
+/*
+ * Read the rest of a function definition whose first line (length bytes)
+ * has already been read from input_fd, up to its closing "}", and define
+ * the function. When reading from stdin, "> " prompts for each line.
+ *
+ * Returns 0 on success, -errno on failure (-EINVAL if the input ends
+ * before the body does).
+ */
+int define_function(int input_fd, const char *first_line, int length)
+{
+    size_t size = length + MAX_INPUT, used = length;
+    char *text = malloc(size);
+    struct script *script;
+    int depth = opens_body(first_line) ? 1 : 0;
+    int ret = 0;
+
+    if (!text) return -ENOMEM;
+    memcpy(text, first_line, length + 1);
+
+    // Nested definitions open bodies of their own
+    while (depth > 0)
+    {
+        if (!input_fd) printf("> ");
+        fflush(stdout);
+
+        if (size - used < MAX_INPUT)
+        {
+            char *grown = realloc(text, 2 * size);
+            if (!grown)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+            text = grown;
+            size *= 2;
+        }
+
+        int rv = read_one_line(input_fd, text + used, size - used);
+        if (rv <= 0)
+        {
+            ret = rv ? rv : -EINVAL;
+            break;
+        }
+        if (opens_body(text + used)) depth++;
+        else if (closes_body(text + used)) depth--;
+        used += rv;
+    }
+
+    // The text is kept for as long as the function is defined
+    if (!ret && !(script = script_parse(text))) ret = -errno;
+    if (ret) free(text);
+    else script_run(script, NULL, false);
+    return ret;
+}
+
+/*
+ * Returns the parsed script of the file open as fd, from
+ * the cache if the file has not changed since it was parsed. The file is
+ * read whole and its text kept with the script.
+ *
+ * Returns NULL on failure, with errno set.
+ */
+static struct script *load_sourced(int fd)
+{
+    struct stat st;
+    struct sourced_file *file;
+    char *text;
+    ssize_t done = 0;
+
+    if (fstat(fd, &st)) return NULL;
+
+    for (file = sourced_files; file; file = file->next)
+        if ((file->dev == st.st_dev) && (file->ino == st.st_ino)) break;
+    if (file && (file->size == st.st_size) && (file->mtime.tv_sec == st.st_mtim.tv_sec) &&
+        (file->mtime.tv_nsec == st.st_mtim.tv_nsec))
+        return file->script;
+
+    text = malloc(st.st_size + 1);
+    if (!text) return NULL;
+    while (done < st.st_size)
+    {
+        ssize_t rv = read(fd, text + done, st.st_size - done);
+        if (rv == 0) break;
+        if (rv < 0)
+        {
+            if (errno == EINTR) continue;
+            free(text);
+            return NULL;
+        }
+        done += rv;
+    }
+    text[done] = '\0';
+
+    struct script *script = script_parse(text);
+    if (!script)
+    {
+        int saved = errno;
+        free(text);
+        errno = saved;
+        return NULL;
+    }
+
+    // An older version stays allocated: functions it defined still use it
+    if (!file)
+    {
+        if (!(file = malloc(sizeof(*file)))) return script;
+        *file = (struct sourced_file){.dev = st.st_dev, .ino = st.st_ino, .next = sourced_files};
+        sourced_files = file;
+    }
+    file->mtime = st.st_mtim;
+    file->size = st.st_size;
+    file->script = script;
+    return script;
+}
+
+// Handle a source command: source FILE [args...]
+int handle_source(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    struct script *script;
+    int saved_in = -1, saved_out = -1;
+    int fd, result;
+
+    if (!args[1])
+    {
+        printf("source: usage: source FILE [args...]\n");
+        return -EINVAL;
+    }
+    if (call_depth == MAX_CALL_DEPTH) return -ELOOP;
+
+    fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        printf("source: %s: %s\n", args[1], strerror(errno));
+        return -errno;
+    }
+    script = load_sourced(fd);
+    close(fd);
+    if (!script)
+    {
+        printf("source: %s: %s\n", args[1], strerror(errno));
+        return -errno;
+    }
+
+    // The file's commands use the shell's stdin and stdout, so point those
+    // at ours for the duration (e.g., "source lib.sh > log")
+    if (stdin != 0)
+    {
+        saved_in = fcntl(0, F_DUPFD_CLOEXEC, 3);
+        dup2(stdin, 0);
+    }
+    if (stdout != 1)
+    {
+        fflush(NULL);
+        saved_out = fcntl(1, F_DUPFD_CLOEXEC, 3);
+        dup2(stdout, 1);
+    }
+
+    // $0 is the file, $1 on are the rest of the arguments
+    call_depth++;
+    result = script_run(script, &args[1], false);
+    call_depth--;
+
+    if (saved_in != -1)
+    {
+        dup2(saved_in, 0);
+        close(saved_in);
+    }
+    if (saved_out != -1)
+    {
+        fflush(NULL);
+        dup2(saved_out, 1);
+        close(saved_out);
+    }
+    return result;
+}
@@ -3,18 +3,61 @@
  * jobs and job control.
  */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "thsh.h"
 
 static char **path_table;
 
+// Print RUNNING/ENDED lines for every command on stderr (thsh -d)
+bool debug_mode = false;
+
+// Deadline for every pipeline stage in milliseconds, 0 for none (thsh --timeout)
+long default_timeout = 0;
+
+// Deadline (now_ms()) of the builtin running in the shell, to which
+// wait_child() holds the commands it starts; 0 for none
+static long builtin_deadline = 0;
+
+// How long a timed-out pipeline gets to exit after SIGTERM before SIGKILL
+#define TIMEOUT_GRACE_MS 2000
+
+// File descriptors kept free for the pipes a pipeline still has to create
+#define FD_RESERVE 16
+
+// Number of command names remembered by find_command()
+#define PATH_CACHE_SIZE 64
+
+struct path_cache_entry
+{
+    char path[MAX_INPUT]; // "<prefix>/<name>"
+    int name_offset;      // index of <name> in path, 0 if the entry is empty
+};
+
+static struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+
+// Set in a child that joined a pipeline's process group; the pipelines
+// it runs itself stay in that group, so a timeout reaches them too
+static bool in_group = false;
+
+// Whether the group of the pipeline being launched gets the terminal
+static bool group_terminal = false;
+
 // Helper functions
 char *replace_pattern(char *path_prefixes);
+static int exec_command(char *path, char *args[MAX_ARGS], int stdin, int stdout, int cpu);
 
 /* 
  * Initialize the table of PATH prefixes.
@@ -41,6 +84,9 @@ int init_path(void)
     // Gets the environment path
     char *path = getenv("PATH");
 
+    // Forget commands resolved with a previous table
+    memset(path_cache, 0, sizeof(path_cache));
+
     // Ignore empty paths
     if ((path == NULL) || (strlen(path) == 0))
     {
@@ -51,26 +97,31 @@ int init_path(void)
 
     char *env_var_copy = strdup(path);
     char *path_prefixes;
+    char *expanded;
     int index = 0;
+    int entries = 2; // one prefix plus the NULL terminator
 
-    path_table = malloc(strlen(env_var_copy) * sizeof(char *));
+    // One more prefix per ':' separator (an empty "::" prefix becomes ".")
+    for (int i = 0; path[i]; i++)
+        if (path[i] == ':') entries++;
+
+    path_table = malloc(entries * sizeof(char *));
 
     // Ignores trailing spaces
     path_prefixes = strtok(env_var_copy, " \t");
 
     // Searches for pattern "::" to replace with "./"
-    path_prefixes = replace_pattern(path_prefixes);
+    expanded = replace_pattern(path_prefixes ? path_prefixes : "");
 
     // Ignores trailing slashes '/'
-    for (int i = strlen(path_prefixes) - 1; i >= 0; i--)
+    for (int i = strlen(expanded) - 1; i >= 0; i--)
     {
-        if (path_prefixes[i] != '/') break;
-        else if (path_prefixes[i] == '/') path_prefixes[i] = '\0';
+        if (expanded[i] != '/') break;
+        else if (expanded[i] == '/') expanded[i] = '\0';
     }
-    path_prefixes = strdup(path_prefixes);
 
     // Searches for the first ':' character and finds the first path prefix
-    path_prefixes = strtok(path_prefixes, ":");
+    path_prefixes = strtok(expanded, ":");
 
     // Find all the ':' characters and get all the path prefixes
     while (path_prefixes != NULL)
@@ -84,7 +135,7 @@ int init_path(void)
 
     // Free space in memory
     free(env_var_copy);
-    free(path_prefixes);
+    free(expanded);
     return 0;
 }
 
@@ -105,26 +156,151 @@ void print_path_table()
     printf("===== End Path Table =====\n");
 }
 
-// Helper function that replaces the pattern "::" with './'
-// This function also takes care of removing trailing slashes
+// Helper function that replaces the pattern "::" with ":.:"
+// Returns a newly allocated copy of path_prefixes, which is left untouched
 char *replace_pattern(char *path_prefixes)
 {
-    for (int i = 0; i < (strlen(path_prefixes) - 1); i++)
+    // Worst case every other character is a ':' that needs a '.' after it
+    char *new_path = malloc(2 * strlen(path_prefixes) + 1);
+    int k = 0;
+
+    for (int i = 0; path_prefixes[i]; i++)
+    {
+        new_path[k++] = path_prefixes[i];
+        if ((path_prefixes[i] == ':') && (path_prefixes[i + 1] == ':')) new_path[k++] = '.';
+    }
+    new_path[k] = '\0';
+    return new_path;
+}
+
+// Returns the current CLOCK_MONOTONIC time in milliseconds
+static long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * Wait for the child pid started by a builtin running in the shell, and
+ * store its wait() status in *wstatus. If the builtin has a deadline,
+ * the child gets SIGTERM once it passes, then SIGKILL if it has not
+ * exited TIMEOUT_GRACE_MS later, as a pipeline stage would.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int wait_child(int pid, const char *name, int *wstatus)
+{
+    int pidfd = builtin_deadline ? pidfd_open(pid, 0) : -1;
+    long deadline = builtin_deadline;
+    int sig = SIGTERM;
+
+    // Without a deadline (or a pidfd), just block
+    while (pidfd != -1)
+    {
+        struct pollfd fd = {.fd = pidfd, .events = POLLIN};
+        long timeout = deadline - now_ms();
+        int ready = poll(&fd, 1, (timeout > 0) ? timeout : 0);
+
+        if ((ready == -1) && (errno == EINTR)) continue;
+        if (ready != 0) break;
+
+        if (sig == SIGTERM)
+        {
+            fprintf(stderr, "thsh: timeout: [%s] ran out of time\n", name);
+            trace_instant("timeout", 0, trace_now(), NULL, 0);
+        }
+        pidfd_send_signal(pidfd, sig, NULL, 0);
+        deadline = now_ms() + TIMEOUT_GRACE_MS;
+        sig = SIGKILL;
+    }
+    if (pidfd != -1) close(pidfd);
+
+    while (waitpid(pid, wstatus, 0) == -1)
+        if (errno != EINTR) return -errno;
+    return 0;
+}
+
+/* 
+ * Parse a duration such as "10", "1.5s", "250ms", "2m" or "1h" (plain
+ * numbers are seconds).
+ *
+ * Returns the duration in milliseconds, or -EINVAL if text is not valid.
+ */
+long parse_duration(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+
+    if ((unit == text) || (value < 0)) return -EINVAL;
+
+    if ((strcmp(unit, "") == 0) || (strcmp(unit, "s") == 0)) value *= 1000;
+    else if (strcmp(unit, "m") == 0) value *= 60 * 1000;
+    else if (strcmp(unit, "h") == 0) value *= 60 * 60 * 1000;
+    else if (strcmp(unit, "ms") != 0) return -EINVAL;
+
+    return (long)value;
+}
+
+/* 
+ * Resolve a command name to the path of its binary, writing it into path
+ * (size bytes). Names starting with '.' or '/' are used as-is; anything else
+ * is looked up in path_table.
+ *
+ * Successful lookups are remembered in path_cache, a small direct-mapped
+ * table of static buffers, so a warmed-up shell resolves the commands it
+ * runs over and over without touching the heap or stat()ing every prefix.
+ *
+ * Returns 0 on success, -ENOENT if the command cannot be found.
+ */
+static int find_command(const char *name, char *path, size_t size)
+{
+    struct stat st;
+    unsigned long hash = 5381;
+    struct path_cache_entry *entry;
+
+    // If is an absolute or relative path, use it as-is
+    if ((name[0] == '.') || (name[0] == '/'))
     {
-        if ((path_prefixes[i] == ':') && (path_prefixes[i + 1] == ':'))
+        snprintf(path, size, "%s", name);
+        return 0;
+    }
+
+    // The path table is only built once a command actually needs it
+    if (!path_table && init_path()) return -ENOENT;
+
+    for (const char *c = name; *c; c++) hash = hash * 33 + *c;
+    entry = &path_cache[hash % PATH_CACHE_SIZE];
+
+    // Cache hit: the entry holds "<prefix>/<name>"; re-check it still exists
+    if (entry->name_offset && (strcmp(entry->path + entry->name_offset, name) == 0))
+    {
+        if (stat(entry->path, &st) == 0)
         {
-            char *new_path = strdup(path_prefixes);
-            new_path = realloc(new_path, (strlen(new_path) + 1) * sizeof(char *));
-            new_path[i + 1] = '.';
+            stats_add(STAT_PATH_HITS, 1);
+            snprintf(path, size, "%s", entry->path);
+            return 0;
+        }
+        entry->name_offset = 0;
+    }
+    stats_add(STAT_PATH_MISSES, 1);
 
-            for (int k = i + 1; k < strlen(path_prefixes); k++) new_path[k + 1] = path_prefixes[k];
+    // Look for command on path_table, concatenating it with each entry
+    for (int index = 0; path_table[index] != NULL; index++)
+    {
+        int length = snprintf(path, size, "%s/%s", path_table[index], name);
+        if ((length >= size) || (stat(path, &st) != 0)) continue;
 
-            i = i + 2; // to keep checking the path after replacing the characters "::"
-            free(path_prefixes);
-            path_prefixes = new_path;
+        // Remember the hit if it fits in the cache entry
+        if (length < sizeof(entry->path))
+        {
+            strcpy(entry->path, path);
+            entry->name_offset = length - strlen(name);
         }
+        return 0;
     }
-    return path_prefixes;
+    return -ENOENT;
 }
 
 /* 
@@ -151,60 +327,851 @@ char *replace_pattern(char *path_prefixes)
  */
 int run_command(char *args[MAX_ARGS], int stdin, int stdout, bool wait)
 {
-    int rv = 0;
-    struct stat st;
-    char *checking_path;
-    int index = 0;
+    int status;
+    int pid = spawn_command(args, stdin, stdout, -1, -1, NULL);
 
-    // If is not an absolute path, look for command on path_table
-    if (!((args[0][0] == '.') || (args[0][0] == '/')))
-    {
-        do
-        {
-            // If path_table is null, command not found, return -errno
-            if (path_table[index] == NULL) return -errno;
+    if (pid < 0) return pid;
+    if (wait) waitpid(pid, &status, 0);
+    return 0;
+}
+
+// Gives the terminal (fd 0) to process group pgid; SIGTTOU is blocked
+// meanwhile, as the caller may be in the background
+static void give_terminal(int pgid)
+{
+    sigset_t ttou, saved;
+
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &saved);
+    tcsetpgrp(0, pgid);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/*
+ * In a child forked for a stage: move to process group pgid, or to a new
+ * one if pgid is 0 (nothing is done if it is -1), and take the terminal
+ * if the group gets it, or the stage could be stopped on reading from it
+ * before the shell hands it over.
+ */
+static void join_group(int pgid)
+{
+    if ((pgid < 0) || setpgid(0, pgid)) return;
+    in_group = true;
+    if (group_terminal) give_terminal(getpgrp());
+}
+
+/* 
+ * Move stdin and stdout onto fds 0 and 1, pin to cpu (unless it is -1)
+ * and execv() path with args in the calling process. Only returns if
+ * execv failed, returning errno.
+ */
+static int exec_command(char *path, char *args[MAX_ARGS], int stdin, int stdout, int cpu)
+{
+    // The shell ignores SIGPIPE (see main()), which exec would pass on
+    signal(SIGPIPE, SIG_DFL);
 
-            // Concatenating command with entry in path_table
-            checking_path = malloc(sizeof(path_table[index]) + sizeof(args[0]));
-            strcat(checking_path, path_table[index]);
-            strcat(checking_path, "/");
-            strcat(checking_path, args[0]);
-            index++;
+    // Placement is best effort; the command still runs if it fails
+    affinity_pin(cpu);
 
-        } while (stat(checking_path, &st) != 0); // checking for valid path,
-                                                 // repeat while return != 0
+    if (stdin) // read from file
+    {
+        dup2(stdin, 0);
+        close(stdin);
     }
-    else // it is an absolute path
+    if (stdout != 1) // write to file
     {
-        checking_path = strdup(args[0]);
+        dup2(stdout, 1);
+        close(stdout);
     }
 
+    execv(path, args);
+    return errno;
+}
+
+/* 
+ * Fork a child that runs args with the given stdin and stdout, as
+ * described for run_command(), and return its pid without waiting. The
+ * child is pinned to cpu before it execs, unless cpu is -1, and joins
+ * process group pgid as join_group() describes.
+ *
+ * If exec_fd is not NULL, *exec_fd is set to the read end of a
+ * close-on-exec pipe that reaches EOF as soon as the child's exec
+ * succeeds (if it fails, the child writes its errno there first), so
+ * the caller can time the exec without waiting for it; -1 if the pipe
+ * could not be made.
+ *
+ * Returns the child's pid on success, -errno on failure.
+ */
+int spawn_command(char *args[MAX_ARGS], int stdin, int stdout, int cpu, int pgid, int *exec_fd)
+{
+    int rv = 0;
+    char checking_path[MAX_INPUT]; // resolved binary, no heap allocation needed
+    int exec_pipe[2] = {-1, -1};   // reports exec() to the parent, if asked to
+
+    rv = find_command(args[0], checking_path, sizeof(checking_path));
+    if (rv) return rv;
+
+    if (exec_fd && pipe2(exec_pipe, O_CLOEXEC)) exec_pipe[0] = exec_pipe[1] = -1;
+
+    long fork_start = stats_now();
     int pid = fork();
-    int status;
 
     if (pid < 0) // error when forking
     {
-        return -errno;
+        rv = -errno;
+        if (exec_pipe[0] != -1)
+        {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        return rv;
     }
     else if (pid == 0) // child process
     {
-        if (stdin) // read from file
+        stats_latency(STAT_EXEC, stats_now() - fork_start);
+        join_group(pgid);
+        rv = exec_command(checking_path, args, stdin, stdout, cpu);
+
+        // Only reached if execv failed; never fall back into the shell loop
+        if (exec_pipe[1] != -1) write(exec_pipe[1], &rv, sizeof(rv));
+        _exit(127);
+    }
+
+    // parent process
+    stats_latency(STAT_FORK, stats_now() - fork_start);
+    if (exec_pipe[1] != -1) close(exec_pipe[1]);
+    if (exec_fd) *exec_fd = exec_pipe[0];
+    return pid;
+}
+
+// One stage of a pipeline being run by run_pipeline()
+struct stage
+{
+    char **args;
+    int pid;          // 0 if the stage was a builtin run by the shell, or once reaped
+    int pidfd;        // pidfd of the child, -1 if not available
+    int watch_fd;     // tracing: read end of the pipe this stage writes to
+    int exec_fd;      // tracing: spawn_command()'s pipe, at EOF once the stage exec'd
+    long start;       // tracing: when the stage was forked
+    bool threaded;    // a pure builtin running on thread, until joined
+    pthread_t thread;
+    int std_in;       // threaded: the builtin's stdin and stdout; pipe ends
+    int std_out;      //   (but not the redirection files) are closed by the thread
+    bool close_in, close_out;
+    int retval;       // threaded: value returned by the builtin
+    long end;         // threaded: when the builtin returned
+    long deadline;    // now_ms() by which the stage must finish, 0 for none
+    int cpu;          // CPU the stage is pinned to, -1 for none
+};
+
+// The stages of a running pipeline and wait_pipeline()'s poll set, grown
+// for the longest pipeline so far and reused
+struct stage_set
+{
+    struct stage *stages;
+    struct pollfd *fds;
+    int *owner; // stage index for each entry in fds
+    int capacity;
+};
+
+// One set per nesting level: a builtin such as source runs pipelines of
+// its own while the pipeline that called it is still using its set
+static struct stage_set stage_sets[MAX_CALL_DEPTH + 1];
+static int nesting = 0;
+
+// Makes room for count stages in set; returns 0 or -ENOMEM
+static int reserve_stages(struct stage_set *set, int count)
+{
+    int capacity = set->capacity ? set->capacity : 32;
+    void *grown;
+
+    if (count <= set->capacity) return 0;
+    while (capacity < count) capacity *= 2;
+
+    if (!(grown = realloc(set->stages, capacity * sizeof(*set->stages)))) return -ENOMEM;
+    set->stages = grown;
+    if (!(grown = realloc(set->fds, 3 * capacity * sizeof(*set->fds)))) return -ENOMEM;
+    set->fds = grown;
+    if (!(grown = realloc(set->owner, 3 * capacity * sizeof(*set->owner)))) return -ENOMEM;
+    set->owner = grown;
+    set->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Returns how many fds the shell may keep open for the stages of a
+ * pipeline (pidfds, watch and exec fds when tracing, and the pipe ends
+ * held by builtins running on threads) without using up
+ * RLIMIT_NOFILE, leaving FD_RESERVE for the pipes between them; at most
+ * three for each of the stages that fit in set.
+ */
+static int fd_budget(struct stage_set *set)
+{
+    struct rlimit limit;
+    long budget;
+
+    // The lowest free fd is about how many are open already
+    int lowest = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lowest == -1) return 0;
+    close(lowest);
+
+    // Each stage needs three at most, which also caps RLIM_INFINITY
+    if (getrlimit(RLIMIT_NOFILE, &limit) || (limit.rlim_cur >= 3L * set->capacity + lowest + FD_RESERVE))
+        return 3 * set->capacity;
+    budget = (long)limit.rlim_cur - lowest - FD_RESERVE;
+    return (budget > 0) ? budget : 0;
+}
+
+// pidfd_open() for a stage, if the fd budget allows; -1 otherwise
+static int open_pidfd(int pid, int *budget)
+{
+    int pidfd = (*budget > 0) ? pidfd_open(pid, 0) : -1;
+
+    if (pidfd != -1) (*budget)--;
+    return pidfd;
+}
+
+/*
+ * Close every fd of the calling process above 2, except keep_a and
+ * keep_b; a forked stage that does not exec uses this to drop the pipe
+ * ends of other stages.
+ */
+static void close_other_fds(int keep_a, int keep_b)
+{
+    int keep[2] = {(keep_a < keep_b) ? keep_a : keep_b, (keep_a < keep_b) ? keep_b : keep_a};
+    unsigned int from = 3;
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (keep[k] < (int)from) continue;
+        if (keep[k] > from) close_range(from, keep[k] - 1, 0);
+        from = keep[k] + 1;
+    }
+    close_range(from, ~0U, 0);
+}
+
+/* 
+ * Thread body for a pure builtin in a pipeline: run it on the stage's fds,
+ * then close the pipe ends it was handed so its neighbours see EOF/EPIPE.
+ */
+static void *run_builtin_thread(void *arg)
+{
+    struct stage *stage = arg;
+
+    affinity_pin(stage->cpu);
+    handle_builtin(stage->args, stage->std_in, stage->std_out, &stage->retval);
+    if (stage->close_in) close(stage->std_in);
+    if (stage->close_out) close(stage->std_out);
+    stage->end = trace_now();
+    return NULL;
+}
+
+/* 
+ * Fork a child that runs a stateful builtin (e.g., "cd" in the middle of
+ * a pipeline), so it cannot change the shell itself. The child is pinned
+ * to cpu (unless it is -1), joins process group pgid (see join_group()),
+ * keeps only the fds it was handed, and exits with the builtin's exit
+ * status, or 1 if it failed to run.
+ *
+ * Returns the child's pid on success, -errno on failure.
+ */
+static int spawn_builtin(char *args[MAX_ARGS], int stdin, int stdout, int cpu, int pgid)
+{
+    int val = 0;
+    long fork_start;
+    int pid;
+
+    fflush(NULL); // or the child would write out our buffered output again
+    fork_start = stats_now();
+    pid = fork();
+
+    if (pid < 0) return -errno;
+    if (pid == 0)
+    {
+        // Without an exec, nothing closes the pipe ends of other stages;
+        // holding them would keep neighbours from seeing EOF or EPIPE
+        join_group(pgid);
+        close_other_fds(stdin, stdout);
+        affinity_pin(cpu);
+        handle_builtin(args, stdin, stdout, &val);
+        fflush(NULL);
+        _exit((val < 0) ? 1 : val);
+    }
+    stats_latency(STAT_FORK, stats_now() - fork_start);
+    return pid;
+}
+
+/*
+ * Fork a child that runs a shell function as one stage of a pipeline,
+ * like a subshell: definitions and directory changes it makes do not
+ * reach the shell. The child is pinned to cpu (unless it is -1), joins
+ * process group pgid (see join_group()), reads stdin, writes stdout, and
+ * exits with the function's exit status.
+ *
+ * Returns the child's pid on success, -errno on failure.
+ */
+static int spawn_function(char *args[MAX_ARGS], int stdin, int stdout, int cpu, int pgid)
+{
+    int status = 0;
+    long fork_start;
+    int pid;
+
+    fflush(NULL); // or the child would write out our buffered output again
+    fork_start = stats_now();
+    if ((pid = fork()) < 0) return -errno;
+    if (pid == 0)
+    {
+        join_group(pgid);
+        affinity_pin(cpu);
+        if (((stdin != 0) && (dup2(stdin, 0) < 0)) || ((stdout != 1) && (dup2(stdout, 1) < 0))) _exit(1);
+        close_other_fds(0, 1);
+        if (run_function(args, false, &status) < 0) status = W_EXITCODE(1, 0);
+        fflush(NULL);
+        _exit(exit_status(status));
+    }
+    stats_latency(STAT_FORK, stats_now() - fork_start);
+    return pid;
+}
+
+/* 
+ * Wait for every child and thread in the first count stages of set to
+ * finish.
+ *
+ * Children are waited for through their pidfds with poll(), so they are
+ * reaped in the order they exit rather than in pipeline order, and the
+ * poll() timeout doubles as the deadline of timed stages. When
+ * tracing, the read end of each stage's output pipe is polled as well,
+ * to record when the stage's first byte of output was seen by the shell,
+ * and so is its exec fd, to record when it exec'd.
+ *
+ * If pgid is above 0, the children are in process group pgid, which is
+ * what a deadline signals, so it also reaches whatever they started.
+ *
+ * Stores the exit status of the last stage in *status.
+ */
+static void wait_pipeline(struct stage_set *set, int count, int pgid, int *status)
+{
+    struct stage *stages = set->stages;
+    struct pollfd *fds = set->fds;
+    int *owner = set->owner;
+    long wait_start = trace_now();
+    int live = 0;
+    int signal_sent = 0;         // SIGTERM, then SIGKILL, once a deadline passes
+    long kill_at = 0;            // when SIGTERM escalates to SIGKILL
+
+    for (int i = 0; i < count; i++)
+        if (stages[i].pid && (stages[i].pidfd != -1)) live++;
+
+    while (live)
+    {
+        int nfds = 0;
+        long deadline = kill_at; // earliest deadline of a live stage
+        long timeout = -1;
+
+        for (int i = 0; i < count; i++)
+        {
+            // Ahead of the pidfd, so an exec is seen before the exit
+            if (stages[i].exec_fd != -1)
+            {
+                fds[nfds] = (struct pollfd){.fd = stages[i].exec_fd, .events = POLLIN};
+                owner[nfds++] = i;
+            }
+            if (stages[i].pid && (stages[i].pidfd != -1))
+            {
+                fds[nfds] = (struct pollfd){.fd = stages[i].pidfd, .events = POLLIN};
+                owner[nfds++] = i;
+                if (!signal_sent && stages[i].deadline && (!deadline || (stages[i].deadline < deadline)))
+                    deadline = stages[i].deadline;
+            }
+            if (stages[i].watch_fd != -1)
+            {
+                fds[nfds] = (struct pollfd){.fd = stages[i].watch_fd, .events = POLLIN};
+                owner[nfds++] = i;
+            }
+        }
+
+        if (deadline)
+        {
+            timeout = deadline - now_ms();
+            if (timeout < 0) timeout = 0;
+        }
+
+        int ready = poll(fds, nfds, timeout);
+        if (ready == -1)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // A deadline passed: report the stages that ran out of time, then
+        // signal every live stage (or their whole group), escalating to
+        // SIGKILL after a grace period
+        if ((ready == 0) && deadline)
+        {
+            int sig = signal_sent ? SIGKILL : SIGTERM;
+
+            for (int i = 0; i < count; i++)
+            {
+                if (!stages[i].pid || (stages[i].pidfd == -1)) continue;
+                if (!signal_sent && stages[i].deadline && (stages[i].deadline <= now_ms()))
+                {
+                    fprintf(stderr, "thsh: timeout: stage %d [%s] ran out of time\n", i + 1, stages[i].args[0]);
+                    trace_instant("timeout", i + 1, trace_now(), NULL, 0);
+                }
+                if (pgid <= 0) pidfd_send_signal(stages[i].pidfd, sig, NULL, 0);
+            }
+            if (pgid > 0) kill(-pgid, sig);
+            signal_sent = sig;
+            kill_at = (sig == SIGTERM) ? now_ms() + TIMEOUT_GRACE_MS : 0;
+            continue;
+        }
+
+        for (int k = 0; k < nfds; k++)
+        {
+            struct stage *stage = &stages[owner[k]];
+
+            if (!fds[k].revents) continue;
+
+            if (fds[k].fd == stage->watch_fd) // output pipe became readable or hung up
+            {
+                if (fds[k].revents & POLLIN) trace_instant("first-byte", owner[k] + 1, trace_now(), NULL, 0);
+                close(stage->watch_fd);
+                stage->watch_fd = -1;
+                continue;
+            }
+            if (fds[k].fd == stage->exec_fd) // EOF once exec succeeds, an errno if it failed
+            {
+                int child_errno;
+
+                if (read(stage->exec_fd, &child_errno, sizeof(child_errno)) == 0)
+                    trace_instant("exec", owner[k] + 1, trace_now(), "pid", stage->pid);
+                close(stage->exec_fd);
+                stage->exec_fd = -1;
+                continue;
+            }
+
+            // The child exited: reap it and stop watching its input pipe,
+            // so the stage feeding it can get SIGPIPE instead of blocking
+            int wstatus = 0;
+            waitpid(stage->pid, &wstatus, 0);
+            close(stage->pidfd);
+            stage->pidfd = -1;
+            live--;
+
+            if (owner[k] == count - 1) *status = wstatus;
+            if ((owner[k] > 0) && (stages[owner[k] - 1].watch_fd != -1))
+            {
+                close(stages[owner[k] - 1].watch_fd);
+                stages[owner[k] - 1].watch_fd = -1;
+            }
+
+            if (trace_enabled())
+            {
+                long now = trace_now();
+                trace_instant("exit", owner[k] + 1, now, "status", exit_status(wstatus));
+                trace_span(stage->args[0], owner[k] + 1, stage->start, now, stage->args);
+            }
+            if (debug_mode) fprintf(stderr, "ENDED: [%s] (ret=0)\n", stage->args[0]);
+            stage->pid = 0; // reaped
+        }
+    }
+
+    // Children without a pidfd (e.g., pidfd_open is not supported) are
+    // reaped in pipeline order instead
+    for (int i = 0; i < count; i++)
+    {
+        int wstatus = 0;
+
+        if (!stages[i].pid || (stages[i].pidfd != -1)) continue;
+        waitpid(stages[i].pid, &wstatus, 0);
+        if (i == count - 1) *status = wstatus;
+        if (debug_mode) fprintf(stderr, "ENDED: [%s] (ret=0)\n", stages[i].args[0]);
+        stages[i].pid = 0;
+    }
+
+    // Threads finish once their neighbours are done with the pipes
+    for (int i = 0; i < count; i++)
+    {
+        if (!stages[i].threaded) continue;
+        pthread_join(stages[i].thread, NULL);
+        stages[i].threaded = false;
+
+        if (i == count - 1) *status = W_EXITCODE((stages[i].retval < 0) ? 1 : stages[i].retval, 0);
+        trace_span(stages[i].args[0], i + 1, stages[i].start, stages[i].end, stages[i].args);
+        if (debug_mode) fprintf(stderr, "ENDED: [%s] (ret=%d)\n", stages[i].args[0], stages[i].retval);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (stages[i].watch_fd != -1) close(stages[i].watch_fd);
+        if (stages[i].exec_fd != -1) close(stages[i].exec_fd);
+        if (stages[i].pidfd != -1) close(stages[i].pidfd);
+    }
+    trace_span("wait", 0, wait_start, trace_now(), NULL);
+}
+
+// Whether some stage of a pipeline will have a deadline, looking only at
+// the prefixes launch_pipeline() strips
+static bool pipeline_timed(char *commands[][MAX_ARGS], int steps)
+{
+    if (default_timeout) return true;
+    for (int i = 0; i < steps; i++)
+    {
+        char **args = commands[i];
+
+        if ((i == 0) && args[0] && (strcmp(args[0], "pin") == 0) && args[1]) args += 2;
+        if (args[0] && (strcmp(args[0], "timeout") == 0)) return true;
+    }
+    return false;
+}
+
+/* 
+ * Launch one parsed pipeline, as produced by parse_line(), of steps stages
+ * tracked in set.
+ *
+ * infile and outfile, if not NULL, are opened for the first stage to read
+ * from and the last stage to write to, respectively. Stages in between are
+ * connected with pipes.
+ *
+ * A builtin on its own runs in the shell itself. Inside a longer pipeline,
+ * a builtin that only uses its stdin and stdout (BUILTIN_PURE) runs on a
+ * thread with its real pipe fds, so no process is created for it; one
+ * that would change the shell's state runs in a forked child instead.
+ *
+ * A stage written as "timeout DURATION command..." must finish within
+ * DURATION (as must every stage, if default_timeout is set). When a stage
+ * runs out of time, the whole pipeline gets SIGTERM, then SIGKILL if it
+ * has not exited TIMEOUT_GRACE_MS later. A builtin whose own stage has a
+ * timeout prefix runs in a forked child, so it can be signalled; under
+ * default_timeout alone, it runs as it would otherwise (so cd and the
+ * like still change the shell), and holds the commands it starts to the
+ * deadline itself, through wait_child(). The children of such a
+ * pipeline share a new process group, so the signals also reach anything
+ * they started; if the shell has the terminal, the group has it until the
+ * pipeline is done.
+ *
+ * Every child and thread is waited for before returning, and the wait()
+ * status of the last stage is stored in *status (a builtin that failed to
+ * run reports exit status 1).
+ *
+ * If exec_last is true, nothing is left for the shell to do after this
+ * pipeline, so an external last stage is exec'd in place of the shell
+ * instead of being forked; on success, this function does not return.
+ *
+ * Returns 0 on success, -errno if a stage could not be started (including
+ * a builtin that failed to run, which stops the pipeline).
+ */
+static int launch_pipeline(struct stage_set *set, char *commands[][MAX_ARGS], int steps, char *infile,
+                           char *outfile, bool exec_last, int *status)
+{
+    struct stage *stages;
+    int count = 0;        // stages started so far
+    int ret = 0;
+    int val = 0;          // return value from builtin command
+    int kind;             // builtin_kind() of the current stage
+    bool function;        // the current stage calls a shell function
+    int in_file = 0;      // temp infile handle
+    int out_file = 1;     // temp outfile handle
+    int next_in = -1;     // read end of the pipe feeding the next stage
+    long start = now_ms(); // deadlines count from the start of the pipeline
+    bool timed = false;    // some stage has a deadline
+    bool threads = false;  // some stage runs on a thread of the shell
+    int policy = default_affinity; // AFFINITY_* placement of the stages
+    int budget;                    // fds left for pidfds and watch fds
+    int pgid = -1;         // process group of the children, 0 until the first is forked
+    bool terminal = false; // the group gets the terminal
+
+    *status = 0;
+    if ((ret = reserve_stages(set, steps))) return ret;
+    stats_add(STAT_PIPELINES, 1);
+    stages = set->stages;
+
+    // Redirection file
+    if (infile)
+    {
+        // Read from file
+        in_file = open(infile, O_RDONLY | O_CLOEXEC);
+        if (in_file == -1) return -errno;
+    }
+    if (outfile)
+    {
+        // Write to file
+        out_file = open(outfile, O_CREAT | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (out_file == -1)
         {
-            dup2(stdin, 0);
-            close(stdin);
+            ret = -errno;
+            if (infile) close(in_file);
+            return ret;
         }
-        if (stdout != 1) // write to file
+    }
+    budget = fd_budget(set);
+
+    // Only a pipeline that may be signalled needs a group of its own; one
+    // already inside a pipeline's group stays there
+    if (!in_group && pipeline_timed(commands, steps))
+    {
+        pgid = 0;
+        terminal = (tcgetpgrp(0) == getpgrp());
+    }
+    group_terminal = terminal;
+
+    for (int i = 0; i < steps; i++) // going through each of the commands in commands
+    {
+        struct stage *stage = &stages[count];
+        int std_in = (i == 0) ? in_file : next_in; // first command reads from file if needed
+        int std_out = out_file;                   // last command writes to file if needed
+        int pipe_fd[2];
+        char **args = commands[i];
+        long deadline = default_timeout ? start + default_timeout : 0;
+        bool prefixed = false; // the deadline comes from a timeout prefix
+
+        // A "pin POLICY" prefix places the stages of this pipeline
+        if ((i == 0) && args[0] && (strcmp(args[0], "pin") == 0))
+        {
+            policy = args[1] ? affinity_parse(args[1]) : -EINVAL;
+            if ((policy < 0) || !args[2])
+            {
+                printf("pin: usage: pin compact|spread|none command [args...]\n");
+                ret = -EINVAL;
+                break;
+            }
+            args += 2;
+        }
+
+        // Strip "timeout DURATION" prefixes, keeping the earliest deadline
+        while (args[0] && (strcmp(args[0], "timeout") == 0))
         {
-            close(stdin);
-            dup2(stdout, 1);
-            close(stdout);
+            long duration = args[1] ? parse_duration(args[1]) : -EINVAL;
+            if (duration <= 0) break;
+            if (!deadline || (start + duration < deadline)) deadline = start + duration;
+            prefixed = true;
+            args += 2;
         }
+        if (deadline) timed = true; // the shell has to stay around to enforce it
+        if (!args[0] || (strcmp(args[0], "timeout") == 0))
+        {
+            printf("timeout: usage: timeout DURATION command [args...]\n");
+            ret = -EINVAL;
+            if (i > 0) close(std_in);
+            break;
+        }
+
+        // Checking for debug flag
+        if (debug_mode) fprintf(stderr, "RUNNING: [%s]\n", args[0]);
+
+        // Every command but the last writes to a new pipe. Pipes are close-on-exec,
+        // so each child only keeps the two ends it dup2()s onto stdin and stdout
+        next_in = -1;
+        if (i < steps - 1)
+        {
+            if (pipe2(pipe_fd, O_CLOEXEC))
+            {
+                ret = -errno;
+                if (i > 0) close(std_in);
+                break;
+            }
+            std_out = pipe_fd[1];
+            next_in = pipe_fd[0];
+        }
+
+        *stage = (struct stage){.args = args, .pid = 0, .pidfd = -1, .watch_fd = -1, .exec_fd = -1,
+                                .start = trace_now(), .deadline = deadline, .cpu = affinity_cpu(policy, i)};
+        count++;
+        function = function_defined(args[0]); // a function hides a builtin of the same name
+        kind = function ? BUILTIN_NONE : builtin_kind(args);
+
+        // run_function() counts function calls
+        if (!function) stats_add((kind == BUILTIN_NONE) ? STAT_EXTERNALS : STAT_BUILTINS, 1);
+
+        // A function inside a pipeline (or redirected) runs in a child; on
+        // its own, run_pipeline() has already run it in the shell
+        if (function)
+        {
+            trace_instant("fork", i + 1, stage->start, NULL, 0);
+            stage->pid = spawn_function(args, std_in, std_out, stage->cpu, pgid);
+            if (stage->pid < 0)
+            {
+                ret = stage->pid;
+                stage->pid = 0;
+            }
+            else stage->pidfd = open_pidfd(stage->pid, &budget);
+        }
+        // Handling builtin commands: a builtin on its own runs in the shell,
+        // unless it was given a timeout of its own, which only a child can
+        // be held to
+        else if ((kind != BUILTIN_NONE) && (steps == 1) && !prefixed)
+        {
+            long outer_deadline = builtin_deadline; // a builtin may run pipelines of its own
 
-        if (execvp(checking_path, args)) return -errno;
+            builtin_deadline = deadline;
+            handle_builtin(args, std_in, std_out, &val);
+            builtin_deadline = outer_deadline;
+            ret = (val < 0) ? val : 0; // a builtin that failed to run reports -errno
+            *status = W_EXITCODE((val < 0) ? 1 : val, 0);
+            trace_span(args[0], i + 1, stage->start, trace_now(), args);
+            if (debug_mode) fprintf(stderr, "ENDED: [%s] (ret=%d)\n", args[0], ret);
+        }
+        // Streams with its neighbours on a thread, no process needed; the
+        // thread keeps its pipe ends open in the shell, so they come out of
+        // the fd budget, and once it is spent the builtin is forked instead
+        else if ((kind == BUILTIN_PURE) && !prefixed && (budget >= 2))
+        {
+            stage->std_in = std_in;
+            stage->std_out = std_out;
+            stage->close_in = (i > 0);
+            stage->close_out = (i < steps - 1);
+
+            ret = -pthread_create(&stage->thread, NULL, run_builtin_thread, stage);
+            stage->threaded = !ret;
+
+            // The thread owns its pipe ends now
+            if (stage->threaded)
+            {
+                budget -= 2;
+                threads = true; // exec'ing the last stage would kill it
+                continue;
+            }
+        }
+        else if (kind != BUILTIN_NONE) // isolated in a child, as in a subshell
+        {
+            trace_instant("fork", i + 1, stage->start, NULL, 0);
+            stage->pid = spawn_builtin(args, std_in, std_out, stage->cpu, pgid);
+            if (stage->pid < 0)
+            {
+                ret = stage->pid;
+                stage->pid = 0;
+            }
+            else stage->pidfd = open_pidfd(stage->pid, &budget);
+        }
+        else if (exec_last && (i == steps - 1) && !timed && !threads) // replace the shell with the last stage
+        {
+            char checking_path[MAX_INPUT];
+            int saved_in, saved_out; // the shell's own stdin and stdout, in case exec fails
+
+            // exec_command() redirects the shell's fds before it execs, so
+            // rule out what can be checked first, and keep 0 and 1 to restore
+            ret = find_command(args[0], checking_path, sizeof(checking_path));
+            if (!ret && access(checking_path, X_OK)) ret = -errno;
+            if (!ret && ((saved_in = fcntl(0, F_DUPFD_CLOEXEC, 3)) == -1)) ret = -errno;
+            if (!ret && ((saved_out = fcntl(1, F_DUPFD_CLOEXEC, 3)) == -1))
+            {
+                ret = -errno;
+                close(saved_in);
+            }
+            if (!ret)
+            {
+                ret = -exec_command(checking_path, args, std_in, std_out, stage->cpu);
+
+                // Still here, so execv() failed (e.g., ENOEXEC): undo the
+                // redirection, and forget the fds exec_command() closed
+                dup2(saved_in, 0);
+                dup2(saved_out, 1);
+                close(saved_in);
+                close(saved_out);
+                signal(SIGPIPE, SIG_IGN);
+                if (std_in)
+                {
+                    if (i == 0) in_file = -1;
+                    std_in = -1;
+                }
+                if (std_out != 1) out_file = std_out = -1;
+            }
+        }
+        else // not a builtin command
+        {
+            // The exec fd is only taken if the pidfd still fits in the budget
+            bool exec_traced = trace_enabled() && (budget >= 2);
+
+            trace_instant("fork", i + 1, stage->start, NULL, 0);
+            stage->pid = spawn_command(args, std_in, std_out, stage->cpu, pgid,
+                                       exec_traced ? &stage->exec_fd : NULL);
+            if (stage->pid < 0)
+            {
+                ret = stage->pid;
+                stage->pid = 0;
+            }
+            else
+            {
+                if (stage->exec_fd != -1) budget--;
+                stage->pidfd = open_pidfd(stage->pid, &budget);
+                if (trace_enabled())
+                {
+                    if ((next_in != -1) && (budget > 0) &&
+                        ((stage->watch_fd = fcntl(next_in, F_DUPFD_CLOEXEC, 0)) != -1))
+                        budget--;
+                }
+            }
+        }
+
+        // The first child leads the group; setting it here as well as in the
+        // child means it exists before the next stage tries to join it
+        if (stage->pid && (pgid != -1))
+        {
+            if (!pgid)
+            {
+                pgid = stage->pid;
+                setpgid(pgid, pgid);
+                if (terminal) give_terminal(pgid);
+            }
+            else setpgid(stage->pid, pgid);
+        }
+
+        // Closing the pipe ends handed to this stage
+        if (i > 0) close(std_in);
+        if (i < steps - 1) close(std_out);
+
+        // If error returned when running command, stop launching stages
+        if (ret)
+        {
+            if (next_in != -1) close(next_in);
+            break;
+        }
     }
-    else // parent process
+
+    wait_pipeline(set, count, pgid, status);
+
+    // Ctrl-C went to the group rather than to the shell; as it would have
+    // killed the shell too before groups, let it still do so
+    if (terminal && (pgid > 0))
     {
-        if (wait) waitpid(pid, &status, 0);
+        give_terminal(getpgrp());
+        if (WIFSIGNALED(*status) && ((WTERMSIG(*status) == SIGINT) || (WTERMSIG(*status) == SIGQUIT)))
+            kill(getpid(), WTERMSIG(*status));
     }
-    return rv;
+
+    // Close file handlers if exist
+    if (infile) close(in_file);
+    if (outfile) close(out_file);
+    return ret;
+}
+
+/*
+ * Run one parsed pipeline, as launch_pipeline() describes. A shell
+ * function called on its own, without redirections, runs in the shell
+ * itself (so it can define functions or change directory for it).
+ *
+ * Pipelines may nest (through source and functions) up to MAX_CALL_DEPTH
+ * deep; deeper ones fail with -ELOOP.
+ */
+int run_pipeline(char *commands[][MAX_ARGS], int steps, char *infile, char *outfile,
+                 bool exec_last, int *status)
+{
+    int ret;
+
+    if ((steps == 1) && !infile && !outfile && function_defined(commands[0][0]))
+        return run_function(commands[0], exec_last, status);
+
+    if (nesting > MAX_CALL_DEPTH) return -ELOOP;
+    nesting++;
+    ret = launch_pipeline(&stage_sets[nesting - 1], commands, steps, infile, outfile, exec_last, status);
+    nesting--;
+    return ret;
+}
+
+// Converts a wait() status to the exit status a shell would report
+int exit_status(int wstatus)
+{
+    if (WIFSIGNALED(wstatus)) return 128 + WTERMSIG(wstatus);
+    return WEXITSTATUS(wstatus);
 }
@@ -0,0 +1,136 @@
+/*
+ * This file implements the allocation accounting mode (thsh -m).
+ *
+ * malloc() and friends are interposed here and forwarded to glibc's
+ * allocator. While accounting is enabled, every allocation is counted
+ * together with its size, so the main loop can tell how many allocations
+ * (and bytes) each command line cost. A summary is printed when the shell
+ * exits; in steady state, a warmed-up shell should report no allocations.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "thsh.h"
+
+// glibc's allocator entry points
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool accounting = false;
+static int shell_pid; // the process that turned accounting on
+
+// Running totals, updated by the allocator hooks (possibly from threads)
+static atomic_ulong alloc_count;
+static atomic_ulong alloc_bytes;
+
+// Per command line bookkeeping, only touched by the main loop
+static unsigned long line_start_count, line_start_bytes;
+static unsigned long lines;               // command lines processed
+static unsigned long lines_allocating;    // lines that made any allocation
+static unsigned long steady_count;        // allocations after the first line
+static unsigned long steady_bytes;
+static unsigned long worst_count, worst_bytes, worst_line;
+
+static inline void count_allocation(size_t size)
+{
+    if (!accounting) return;
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+}
+
+void *malloc(size_t size)
+{
+    count_allocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_allocation(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_allocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+// Prints the accounting summary to stderr; registered with atexit() so it
+// also runs when the shell leaves through the exit builtin (but not when a
+// forked child does)
+static void mem_report(void)
+{
+    if (getpid() != shell_pid) return;
+
+    fprintf(stderr, "===== Allocation Summary =====\n");
+    fprintf(stderr, "Command lines: %lu (%lu allocated)\n", lines, lines_allocating);
+    fprintf(stderr, "Total: %lu allocations, %lu bytes\n",
+            atomic_load(&alloc_count), atomic_load(&alloc_bytes));
+    fprintf(stderr, "Steady state (after line 1): %lu allocations, %lu bytes\n",
+            steady_count, steady_bytes);
+    if (worst_count)
+        fprintf(stderr, "Worst line: %lu (%lu allocations, %lu bytes)\n",
+                worst_line, worst_count, worst_bytes);
+    fprintf(stderr, "===== End Allocation Summary =====\n");
+}
+
+/*
+ * Turn on allocation accounting. Allocations made before this call
+ * (e.g., during start-up) are not counted.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int mem_accounting_init(void)
+{
+    accounting = true;
+    shell_pid = getpid();
+    if (atexit(mem_report)) return -ENOMEM;
+    return 0;
+}
+
+// Marks the start of a command line
+void mem_line_begin(void)
+{
+    line_start_count = atomic_load(&alloc_count);
+    line_start_bytes = atomic_load(&alloc_bytes);
+}
+
+/*
+ * Marks the end of a command line and records what it allocated.
+ * If report is true, the line's counts are also printed to stderr.
+ */
+void mem_line_end(bool report)
+{
+    unsigned long count, bytes;
+
+    if (!accounting) return;
+
+    count = atomic_load(&alloc_count) - line_start_count;
+    bytes = atomic_load(&alloc_bytes) - line_start_bytes;
+    lines++;
+
+    if (report) fprintf(stderr, "ALLOCATED: line %lu (%lu allocations, %lu bytes)\n", lines, count, bytes);
+    if (!count) return;
+
+    lines_allocating++;
+    if (lines > 1)
+    {
+        steady_count += count;
+        steady_bytes += bytes;
+    }
+    if (count > worst_count)
+    {
+        worst_count = count;
+        worst_bytes = bytes;
+        worst_line = lines;
+    }
+}
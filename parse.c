@@ -4,10 +4,18 @@
  */
 
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include "thsh.h"
 
-// Helper functions
-char *file_redirection(char *command, char **infile, char **outfile);
+// Bytes of a script read at once by read_one_line()
+#define READ_CHUNK 65536
+
+// Where parse_line() puts the next word of a stage
+#define WORDS 0   // the stage's argument list
+#define INFILE 1  // right after '<': the input file name
+#define OUTFILE 2 // right after '>': the output file name
+#define SKIP 3    // after a file name: dropped, up to the next '|'
 
 /* 
  * This function returns one line from input_fd.
@@ -16,72 +24,138 @@ char *file_redirection(char *command, char **infile, char **outfile);
  * including a null terminator. Must point to a buffer allocated
  * by the caller, and may not be NULL. size is the size of *buf.
  *
+ * A seekable input (a script) is read READ_CHUNK bytes at a time, and
+ * the lines are handed out of the chunk. Other input (a terminal or a
+ * pipe) is read one character at a time, so nothing past the line is
+ * taken away from the commands that may read the rest of it.
+ *
  * Return value: the length of the string (not counting the null terminator);
  *               zero indicates the end of the input file;
  *               a negative value indicates an error (e.g., -errno)
  */
 int read_one_line(int input_fd, char *buf, size_t size)
 {
-    int count, rv;
-    // pointer to next place in cmd to store a character
-    char *cursor;
-    // the last character that was written into cmd
-    char last_char;
+    static char chunk[READ_CHUNK]; // read ahead of the current line
+    static int chunk_fd = -1;      // the seekable input chunk belongs to
+    static int bytewise_fd = -1;   // the last input found not to be seekable
+    static size_t chunk_start = 0, chunk_end = 0;
+    size_t count = 0;
+    ssize_t rv = 1;
 
     assert(buf);
 
-/*
- * We want to continue reading characters until:
- *     - read() fails (rv will become 0) OR
- *     - count == MAX_INPUT-1 (we have no buffer space left) OR
- *     - last_char was '\n'
- * 
- * So we continue the loop while:
- *     rv is nonzero AND count < MAX_INPUT - 1 AND last_char != '\n'
- *
- * On every iteration, we:
- *     - increment cursor to advance to the next char in the cmd buffer
- *     - increment count to indicate we have stored another char in cmd
- *       (this is done during the loop termination check with "++count")
- *
- * To make the termination check work as intended, the loop starts by:
- *     - setting rv = 1 (so it is initially nonzero)
- *     - setting count = 0 (we have read no characters yet)
- *     - setting cursor = cmd (cursor at start of cmd buffer)
- *     - setting last_char = 1 (so it is initially not '\n')
- *
- * In summary:
- *     - START:
- *       set rv = 1, count = 0, cursor = cmd, last_char = 1
- *     - CONTINUE WHILE:
- *       rv (is nonzero) && count < MAX_INPUT - 1 && last_char != '\n'
- *     - UPDATE PER ITERATION:
- *       increment count and cursor
- */
-    for (rv = 1, count = 0, cursor = buf, last_char = 1;
-         rv && (++count < (size - 1)) && (last_char != '\n'); cursor++)
+    if ((input_fd != chunk_fd) && (input_fd != bytewise_fd))
+    {
+        if (lseek(input_fd, 0, SEEK_CUR) == -1) bytewise_fd = input_fd;
+        else
+        {
+            chunk_fd = input_fd;
+            chunk_start = chunk_end = 0;
+        }
+    }
+
+    if (input_fd == bytewise_fd)
     {
-        // Read one character
-        // File descriptor 0 -> reading from stdin
-        // Writing this one character to cursor (current place in cmd buffer)
-        rv = read(input_fd, cursor, 1);
-        last_char = *cursor;
+        // Read one character at a time, up to and including the newline
+        while ((count < size - 1) && ((rv = read(input_fd, buf + count, 1)) > 0))
+            if (buf[count++] == '\n') break;
     }
+    else
+    {
+        while (count < size - 1)
+        {
+            size_t n;
+            char *newline;
+
+            if (chunk_start == chunk_end)
+            {
+                rv = read(input_fd, chunk, sizeof(chunk));
+                if (rv <= 0) break;
+                chunk_start = 0;
+                chunk_end = rv;
+            }
+
+            // Copy up to the newline, or as much as fits
+            n = chunk_end - chunk_start;
+            if (n > size - 1 - count) n = size - 1 - count;
+            newline = memchr(chunk + chunk_start, '\n', n);
+            if (newline) n = newline - (chunk + chunk_start) + 1;
+            memcpy(buf + count, chunk + chunk_start, n);
+            count += n;
+            chunk_start += n;
+            if (newline) break;
+        }
+
+        // Our stdin is also the stdin of the commands we run; give back
+        // what was read past the line, so they start right after it
+        if ((input_fd == 0) && (chunk_start != chunk_end))
+        {
+            lseek(input_fd, -(off_t)(chunk_end - chunk_start), SEEK_CUR);
+            chunk_start = chunk_end = 0;
+        }
+    }
+
     // Null terminate cmd buffer (so that it will print correctly)
-    *cursor = '\0';
+    buf[count] = '\0';
 
     // Deal with an error from the read call
-    if (!rv) count = -errno;
+    if (rv < 0) return -errno;
+    stats_add(STAT_BYTES_READ, count);
     return count;
 }
 
+/*
+ * Read one whole line from input_fd, however long it is, as read_one_line()
+ * does. *buf (*size bytes) is grown with realloc() as the line needs, and
+ * may start out as NULL (and 0); it can be reused for the next line.
+ *
+ * Return value: as for read_one_line(); -ENOMEM if *buf could not grow.
+ */
+int read_line(int input_fd, char **buf, size_t *size)
+{
+    size_t count = 0;
+
+    while (true)
+    {
+        // Double the buffer whenever the line fills it
+        if (*size - count < 2)
+        {
+            size_t grown_size = *size ? 2 * *size : MAX_INPUT;
+            char *grown = realloc(*buf, grown_size);
+            if (!grown) return -ENOMEM;
+            *buf = grown;
+            *size = grown_size;
+        }
+
+        int rv = read_one_line(input_fd, *buf + count, *size - count);
+        if (rv < 0) return rv;
+        count += rv;
+
+        // Stop at the newline, or at the end of the input
+        if (!rv || ((*buf)[count - 1] == '\n') || (count < *size - 1)) return count;
+    }
+}
+
+// Doubles the number of stages table can hold; returns 0 or -ENOMEM
+static int grow_table(struct command_table *table)
+{
+    int capacity = table->capacity ? 2 * table->capacity : 8;
+    char *(*grown)[MAX_ARGS] = realloc(table->commands, capacity * sizeof(*grown));
+
+    if (!grown) return -ENOMEM;
+    table->commands = grown;
+    table->capacity = capacity;
+    return 0;
+}
+
 /* 
  * Parse one line of input.
  *
  * This function should populate a two-dimensional array of commands
- * and tokens. The array itself should be pre-allocated by the caller.
+ * and tokens, table->commands. The table may start out empty ({NULL, 0});
+ * it is grown as needed, and can be reused for the next line.
  *
- * The first level of the array is each stage in a pipeline, at most MAX_PIPELINE long.
+ * The first level of the array is each stage in a pipeline, with no limit on their number.
  * The second level of the array is each argument to a given command, at most MAX_ARGS entries.
  * In each command buffer, the entry after the last valid entry should be NULL.
  * After the last valid pipeline buffer, there should be one command entry with just a NULL.
@@ -132,87 +206,100 @@ int read_one_line(int input_fd, char *buf, size_t size)
  *
  * length: the length of the string in inbuf. Should be less than the size of inbuf.
  *
- * commands: a two-dimensional array of character pointers, allocated by the caller, which
- *           this function populates.
+ * table: the table of stages, owned by the caller, which this function populates
+ *        (growing table->commands with realloc()).
  *
- * return value: number of entries populated in commands (1+, not counting the NULL),
- *               or -errno on failure.
+ * return value: number of entries populated in table->commands (1+, not counting the NULL),
+ *               or -errno on failure (-E2BIG if a stage has more than MAX_ARGS - 1 words).
  */
-int parse_line(char *inbuf, size_t length,
-               char *commands[MAX_PIPELINE][MAX_ARGS],
+int parse_line(char *inbuf, size_t length, struct command_table *table,
                char **infile, char **outfile)
 {
-    char *outercmd;
-    char *innercmd;
-    char *addr = NULL;
+    struct scan_masks masks;
+    char tail[SCAN_BLOCK];      // zero-padded copy of the last partial block
+    uint64_t in_word = 0;       // 1 if the byte before this block is part of a word
+    int mode = WORDS;           // where the next word goes
     int i = 0;
+    int j = 0;
 
-    // In the case of a line with no actual commands (e.g., a line with just comments), return 0
-    if ((inbuf[0] == '#') || (inbuf[0] == '\n') || (strlen(inbuf) == 0)) return 0;
-
-    // Ignores end of line and comments
-    outercmd = strdup(strtok(inbuf, "\n"));
-    outercmd = strdup(strtok(outercmd, "#"));
+    // Room for the first stage and the terminating entry
+    if ((table->capacity < 2) && grow_table(table)) return -ENOMEM;
 
-    // Divides the command based on the pipe character
-    outercmd = strtok_r(outercmd, "|", &addr);
+    // In the case of a line with no actual commands (e.g., a line with just comments), return 0
+    if ((inbuf[0] == '#') || (inbuf[0] == '\n') || (inbuf[0] == '\0')) return 0;
 
-    while (outercmd != NULL)
+    // The line is classified one block at a time, and tokenized in place by
+    // walking the bits of interest, so every pointer placed in commands,
+    // infile and outfile points into inbuf
+    for (size_t base = 0;; base += SCAN_BLOCK)
     {
-        int j = 0;
+        const char *block = inbuf + base;
 
-        // Checks for file redirection looking for '<' or '>' and specify
-        // the proper values of infile and outfile
-        outercmd = file_redirection(outercmd, infile, outfile);
-
-        // Divides the command based on spaces or tabs
-        innercmd = strdup(outercmd);
-        innercmd = strtok(innercmd, " \t");
-
-        while (innercmd != NULL)
+        // Never read past the caller's buffer; the padding reads as the end
+        if (length - base < SCAN_BLOCK)
         {
-            // Stores each of the commands on the 2D table
-            commands[i][j] = innercmd;
-            innercmd = strtok(NULL, " \t");
-            j++;
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, inbuf + base, length - base);
+            block = tail;
         }
-        // Adds the null terminator at the end of the row
-        commands[i][j] = '\0';
-        outercmd = strtok_r(NULL, "|", &addr);
-        i++;
-    }
-    // Adds the null terminator after the last valid pipeline buffer
-    commands[i][0] = '\0';
+        scan_block(block, &masks);
 
-    // Gets rid of trailing spaces in the files name
-    *infile = strtok(*infile, " \t");
-    *outfile = strtok(*outfile, " \t");
+        // The line ends at a newline, a comment or the terminator; treat the
+        // rest of the block as spaces
+        uint64_t end = masks.newline | masks.comment | masks.nul;
+        uint64_t valid = end ? (end & -end) - 1 : ~0ULL;
+        uint64_t special = (masks.pipe | masks.in | masks.out) & valid;
+        uint64_t word = ~(masks.space | special | ~valid);
+        uint64_t starts = word & ~((word << 1) | in_word);
+        uint64_t ends = ~word & ((word << 1) | in_word);
+        uint64_t events = starts | ends | special;
 
-    return i;
-}
-
-// Helper function to check for file redirection looking for
-// '<' or '>' and specify the proper values of infile and outfile
-char *file_redirection(char *command, char **infile, char **outfile)
-{
-    for (int index = 0; index < strlen(command); index++)
-    {
-        if (command[index] == '<') // in case of '<' character, modify the infile variable
+        in_word = word >> 63;
+        for (; events; events &= events - 1)
         {
-            command[index] = '\0';
+            uint64_t bit = events & -events;
+            char *cursor = inbuf + base + __builtin_ctzll(events);
 
-            while ((command[index + 1] == ' ') || (command[index + 1] == '\t'))
-                index++;
-            *infile = memset(command + index + 1, command[index + 1], sizeof(char));
-        }
-        else if (command[index] == '>') // in case of '>' character, modify the outfile variable
-        {
-            command[index] = '\0';
+            // Terminate the word that ends here, whatever the delimiter is
+            if (ends & bit) *cursor = '\0';
 
-            while ((command[index + 1] == ' ') || (command[index + 1] == '\t'))
-                index++;
-            *outfile = memset(command + index + 1, command[index + 1], sizeof(char));
+            if (starts & bit)
+            {
+                if ((mode == WORDS) && (j == MAX_ARGS - 1)) return -E2BIG;
+                if (mode == WORDS) table->commands[i][j++] = cursor; // stores each of the commands on the 2D table
+                else if (mode == INFILE) *infile = cursor;
+                else if (mode == OUTFILE) *outfile = cursor;
+                if (mode != WORDS) mode = SKIP; // words after a file name are dropped
+            }
+            else if (masks.pipe & bit) // divides the command based on the pipe character
+            {
+                // Adds the null terminator at the end of the row, and skips
+                // stages with no words in them (e.g., a stage of just spaces)
+                table->commands[i][j] = '\0';
+                if (j) i++;
+                j = 0;
+                if ((i + 1 == table->capacity) && grow_table(table)) return -ENOMEM;
+                mode = WORDS;
+            }
+            else if (masks.in & bit) // the next word names the infile
+            {
+                *infile = NULL;
+                mode = INFILE;
+            }
+            else if (masks.out & bit) // the next word names the outfile
+            {
+                *outfile = NULL;
+                mode = OUTFILE;
+            }
         }
+        if (end) break;
     }
-    return command;
+
+    // Adds the null terminator after the last stage and the last valid
+    // pipeline buffer
+    table->commands[i][j] = '\0';
+    if (j) i++;
+    table->commands[i][0] = '\0';
+
+    return i;
 }
@@ -12,19 +12,19 @@ int main(int argc, char **argv, char **envp)
     bool finished = 0;
     // Buffer to hold current command
     int ret = 0;
+    // Buffers for the current command and its stages, grown as needed
+    char *buf = NULL;
+    size_t size = 0;
+    struct command_table parsed = {NULL, 0};
 
     do
     {
         int length;
-        char cmd[MAX_INPUT];
-        // Get a pointer to cmd that type-checks with char *
-        char *buf = &cmd[0];
-        char *parsed_commands[MAX_PIPELINE][MAX_ARGS];
         char *infile = NULL;
         char *outfile = NULL;
 
         // Read a line of input
-        length = read_one_line(0, buf, MAX_INPUT);
+        length = read_line(0, &buf, &size);
         if (length <= 0)
         {
             ret = length;
@@ -32,7 +32,8 @@ int main(int argc, char **argv, char **envp)
         }
 
         // Pass it to the parser
-        ret = parse_line(buf, length, parsed_commands, &infile, &outfile);
+        ret = parse_line(buf, length, &parsed, &infile, &outfile);
+        char *(*parsed_commands)[MAX_ARGS] = parsed.commands;
 
         if (ret == 0)
         {
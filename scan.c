@@ -0,0 +1,161 @@
+/*
+ * This file implements the delimiter scanner used by the parser.
+ *
+ * scan_block() classifies 64 bytes of input at a time, producing one
+ * bitmask per class of interesting character (bit i set means byte i of
+ * the block is in that class). The parser then walks the set bits instead
+ * of the bytes, so a long word or a run of spaces costs a few bit
+ * operations rather than a loop iteration per character.
+ *
+ * There are three implementations, picked at run time on first use:
+ * AVX2 (32 bytes per compare) if the CPU has it, SSE2 (16 bytes, always
+ * present on x86-64), and a scalar loop everywhere else. Setting
+ * THSH_SCAN to "avx2", "sse2" or "scalar" forces one of them, so their
+ * results can be compared.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "thsh.h"
+
+static void scan_resolve(const char *block, struct scan_masks *masks);
+
+// The implementation in use, set by scan_select() (from scan_resolve() on
+// the first call, unless one was selected before)
+static void (*scan_impl)(const char *block, struct scan_masks *masks) = scan_resolve;
+static const char *scan_impl_name = "unresolved";
+
+// Class of each byte for scan_scalar(): 1 + its field in struct scan_masks
+static const unsigned char byte_class[256] = {
+    ['\n'] = 1, ['#'] = 2, ['|'] = 3, ['<'] = 4, ['>'] = 5,
+    ['"'] = 6, ['\''] = 6, [' '] = 7, ['\t'] = 7, ['\0'] = 8,
+};
+
+// Classifies one byte at a time, for CPUs without the vector paths
+static void scan_scalar(const char *block, struct scan_masks *masks)
+{
+    uint64_t found[9] = {0}; // found[0] collects every other byte
+
+    for (int i = 0; i < SCAN_BLOCK; i++) found[byte_class[(unsigned char)block[i]]] |= 1ULL << i;
+
+    *masks = (struct scan_masks){.newline = found[1], .comment = found[2], .pipe = found[3], .in = found[4],
+                                 .out = found[5], .quote = found[6], .space = found[7], .nul = found[8]};
+}
+
+#ifdef SCAN_X86
+// Bitmask of the bytes of v equal to c (16 bits)
+__attribute__((target("sse2"))) static inline uint64_t match16(__m128i v, char c)
+{
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+// Classifies the block 16 bytes at a time
+__attribute__((target("sse2"))) static void scan_sse2(const char *block, struct scan_masks *masks)
+{
+    *masks = (struct scan_masks){0};
+
+    for (int i = 0; i < SCAN_BLOCK; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+
+        masks->newline |= match16(v, '\n') << i;
+        masks->comment |= match16(v, '#') << i;
+        masks->pipe |= match16(v, '|') << i;
+        masks->in |= match16(v, '<') << i;
+        masks->out |= match16(v, '>') << i;
+        masks->quote |= (match16(v, '"') | match16(v, '\'')) << i;
+        masks->space |= (match16(v, ' ') | match16(v, '\t')) << i;
+        masks->nul |= match16(v, '\0') << i;
+    }
+}
+
+// Bitmask of the bytes of v equal to c (32 bits)
+__attribute__((target("avx2"))) static inline uint64_t match32(__m256i v, char c)
+{
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+// Classifies the block 32 bytes at a time
+__attribute__((target("avx2"))) static void scan_avx2(const char *block, struct scan_masks *masks)
+{
+    *masks = (struct scan_masks){0};
+
+    for (int i = 0; i < SCAN_BLOCK; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+
+        masks->newline |= match32(v, '\n') << i;
+        masks->comment |= match32(v, '#') << i;
+        masks->pipe |= match32(v, '|') << i;
+        masks->in |= match32(v, '<') << i;
+        masks->out |= match32(v, '>') << i;
+        masks->quote |= (match32(v, '"') | match32(v, '\'')) << i;
+        masks->space |= (match32(v, ' ') | match32(v, '\t')) << i;
+        masks->nul |= match32(v, '\0') << i;
+    }
+}
+#endif
+
+/*
+ * Use the implementation called name ("avx2", "sse2" or "scalar"), or the
+ * fastest one the CPU supports if name is NULL.
+ *
+ * Returns 0 on success, -EINVAL if name is unknown, or -ENOTSUP if the
+ * CPU cannot run it.
+ */
+int scan_select(const char *name)
+{
+    bool any = !name;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if ((any || (strcmp(name, "avx2") == 0)) && __builtin_cpu_supports("avx2"))
+    {
+        scan_impl = scan_avx2;
+        scan_impl_name = "avx2";
+        return 0;
+    }
+    if ((any || (strcmp(name, "sse2") == 0)) && __builtin_cpu_supports("sse2"))
+    {
+        scan_impl = scan_sse2;
+        scan_impl_name = "sse2";
+        return 0;
+    }
+#endif
+    if (any || (strcmp(name, "scalar") == 0))
+    {
+        scan_impl = scan_scalar;
+        scan_impl_name = "scalar";
+        return 0;
+    }
+    return ((strcmp(name, "avx2") == 0) || (strcmp(name, "sse2") == 0)) ? -ENOTSUP : -EINVAL;
+}
+
+// Picks the implementation (THSH_SCAN, or the fastest), then runs it
+static void scan_resolve(const char *block, struct scan_masks *masks)
+{
+    if (scan_select(getenv("THSH_SCAN"))) scan_select(NULL);
+    scan_impl(block, masks);
+}
+
+/*
+ * Classify the SCAN_BLOCK bytes at block (all of which must be readable)
+ * into masks.
+ */
+void scan_block(const char *block, struct scan_masks *masks)
+{
+    scan_impl(block, masks);
+}
+
+// Returns the name of the implementation scan_block() uses
+const char *scan_name(void)
+{
+    if ((scan_impl == scan_resolve) && scan_select(getenv("THSH_SCAN"))) scan_select(NULL);
+    return scan_impl_name;
+}
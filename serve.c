@@ -0,0 +1,329 @@
+/*
+ * This file implements server mode (thsh --serve PATH) and its client
+ * (thsh --connect PATH command...).
+ *
+ * A resident thsh listens on a Unix socket and runs command lines for
+ * its clients, so they do not pay for shell start-up (init_cwd(),
+ * init_path(), exec'ing thsh) on every command. Connections are handed to
+ * a fixed pool of worker threads through a bounded queue; each request
+ * runs in a child forked from the warm server, inside the client's cwd
+ * and environment, with the client's stdin/stdout/stderr.
+ *
+ * Protocol (one request per connection, all integers in host order):
+ *
+ *     client -> server: uint32_t length, sent with SCM_RIGHTS carrying
+ *                       the client's stdin, stdout and stderr (3 fds)
+ *                       then length bytes of payload:
+ *                       "<cwd>\0<command line>\0<NAME=VALUE>\0...", i.e.
+ *                       the cwd, the command line (which may hold several
+ *                       lines separated by '\n') and the environment
+ *     server -> client: int32_t exit status of the last command, as a
+ *                       shell reports it (128 + signal number if killed)
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "thsh.h"
+
+// Number of requests that can run at the same time
+#define SERVE_WORKERS 8
+
+// Accepted connections waiting for a free worker; accept() blocks when full
+#define SERVE_QUEUE 64
+
+// Largest request payload accepted (cwd, command line and environment)
+#define SERVE_MAX_PAYLOAD (1024 * 1024)
+
+// Seconds a client may take to send its request before the worker gives up
+#define SERVE_RECV_TIMEOUT 5
+
+// Bounded queue of accepted connections, shared by the pool
+static int queue[SERVE_QUEUE];
+static int queue_head = 0, queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+extern char **environ;
+
+// Reads exactly size bytes from fd; returns 0 on success, -errno on failure
+static int read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t rv = read(fd, (char *)buf + done, size - done);
+        if (rv == 0) return -ECONNRESET;
+        if (rv < 0)
+        {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        done += rv;
+    }
+    return 0;
+}
+
+/*
+ * Child side of a request: adopt the client's fds, cwd and environment,
+ * run the command line and exit with its status. Never returns.
+ */
+static void run_request(int fds[3], char *payload, size_t length)
+{
+    char *cwd = payload;
+    char *commands = cwd + strlen(cwd) + 1;
+    char *env = commands + strlen(commands) + 1;
+    char *server_path = getenv("PATH");
+    char **envp;
+    int count = 0;
+
+    // Other workers' client fds may be open in this child; keep only ours
+    for (int i = 0; i < 3; i++) dup2(fds[i], i);
+    closefrom(3);
+
+    // Build the client's environment in place; entries point into payload
+    for (char *e = env; e < payload + length; e += strlen(e) + 1) count++;
+    envp = malloc((count + 1) * sizeof(char *));
+    count = 0;
+    for (char *e = env; e < payload + length; e += strlen(e) + 1) envp[count++] = e;
+    envp[count] = NULL;
+
+    // Only rebuild the path table if the client's PATH differs from ours
+    server_path = server_path ? strdup(server_path) : NULL;
+    environ = envp;
+    if (!server_path || !getenv("PATH") || strcmp(server_path, getenv("PATH"))) init_path();
+
+    if (chdir(cwd) || init_cwd())
+    {
+        fprintf(stderr, "thsh: cannot change directory to %s: %s\n", cwd, strerror(errno));
+        _exit(1);
+    }
+
+    // Nothing runs after the command line, so its last stage can replace us
+    int status = run_string(commands, true);
+    fflush(NULL);
+    _exit(status);
+}
+
+/*
+ * Serve a single connection: receive the request and the client's fds,
+ * run it in a forked child and send back its exit status.
+ */
+static void handle_client(int client)
+{
+    uint32_t length;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {.iov_base = &length, .iov_len = sizeof(length)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg;
+    int fds[3] = {-1, -1, -1};
+    int received = 0; // fds found in the control messages
+    char *payload = NULL;
+    int32_t result = 127;
+    int wstatus;
+    ssize_t rv = recvmsg(client, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    // Whatever fds arrived are now ours, even if the request is bad: take
+    // exactly three, and close any others (or all, if there are not three)
+    for (cmsg = (rv >= 0) ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) continue;
+        for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+        {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (received < 3) fds[received] = fd;
+            else close(fd);
+            received++;
+        }
+    }
+    if ((received != 3) || (msg.msg_flags & MSG_CTRUNC))
+    {
+        for (int i = 0; i < 3; i++)
+            if (fds[i] != -1) close(fds[i]);
+        return;
+    }
+
+    if ((rv != sizeof(length)) || (length < 2) || (length > SERVE_MAX_PAYLOAD)) goto out;
+
+    // The payload must hold at least the cwd and the command line, and end
+    // in a terminator, so run_request() cannot overrun it
+    payload = malloc(length + 1);
+    if (!payload || read_full(client, payload, length)) goto out;
+    payload[length] = '\0';
+    if ((payload[length - 1] != '\0') || (memchr(payload, '\0', length) == payload + length - 1)) goto out;
+
+    int pid = fork();
+    if (pid == 0) run_request(fds, payload, length);
+    if (pid > 0)
+    {
+        while ((waitpid(pid, &wstatus, 0) == -1) && (errno == EINTR))
+            ;
+        result = exit_status(wstatus);
+    }
+
+out:
+    send(client, &result, sizeof(result), MSG_NOSIGNAL);
+    for (int i = 0; i < 3; i++)
+        if (fds[i] != -1) close(fds[i]);
+    free(payload);
+}
+
+// Worker thread: serve connections from the queue forever
+static void *serve_worker(void *arg)
+{
+    while (true)
+    {
+        int client;
+
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_count) pthread_cond_wait(&queue_not_empty, &queue_lock);
+        client = queue[queue_head];
+        queue_head = (queue_head + 1) % SERVE_QUEUE;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_lock);
+
+        handle_client(client);
+        close(client);
+    }
+    return NULL;
+}
+
+/*
+ * Listen on the Unix socket at path and serve requests until killed.
+ * A stale socket file at path is replaced.
+ *
+ * Returns -errno on failure; does not return otherwise.
+ */
+int serve(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    pthread_t workers[SERVE_WORKERS];
+    int listener;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) return -errno;
+
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, SERVE_QUEUE))
+    {
+        int ret = -errno;
+        close(listener);
+        return ret;
+    }
+
+    for (int i = 0; i < SERVE_WORKERS; i++)
+    {
+        int ret = pthread_create(&workers[i], NULL, serve_worker, NULL);
+        if (ret) return -ret;
+    }
+
+    while (true)
+    {
+        struct timeval timeout = {.tv_sec = SERVE_RECV_TIMEOUT};
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1)
+        {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+            return -errno;
+        }
+
+        // A client that stalls mid-request must not hold a worker forever
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == SERVE_QUEUE) pthread_cond_wait(&queue_not_full, &queue_lock);
+        queue[(queue_head + queue_count) % SERVE_QUEUE] = client;
+        queue_count++;
+        pthread_cond_signal(&queue_not_empty);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+/*
+ * Client side: send the words in args (joined by spaces) as one command
+ * line to the server at path, along with our stdin, stdout, stderr, cwd
+ * and environment, and wait for its exit status.
+ *
+ * Returns the exit status of the command, or -errno on failure.
+ */
+int serve_connect(const char *path, char **args)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char cwd[MAX_INPUT];
+    char *payload, *cursor;
+    size_t length = 0;
+    uint32_t header;
+    int32_t result;
+    int fds[3] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(fds))];
+    int sock, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+    if (!getcwd(cwd, sizeof(cwd))) return -errno;
+
+    // Lay out "<cwd>\0<command line>\0<environment>..."
+    length = strlen(cwd) + 1;
+    for (int i = 0; args[i]; i++) length += strlen(args[i]) + 1;
+    for (int i = 0; environ[i]; i++) length += strlen(environ[i]) + 1;
+    if (!args[0]) length++;
+
+    cursor = payload = malloc(length);
+    if (!payload) return -ENOMEM;
+    cursor = stpcpy(cursor, cwd) + 1;
+    *cursor = '\0';
+    for (int i = 0; args[i]; i++)
+    {
+        if (i) *cursor++ = ' ';
+        cursor = stpcpy(cursor, args[i]);
+    }
+    cursor++;
+    for (int i = 0; environ[i]; i++) cursor = stpcpy(cursor, environ[i]) + 1;
+    length = cursor - payload;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((sock == -1) || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        ret = -errno;
+        goto out;
+    }
+
+    header = length;
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if ((sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(header)) ||
+        (send(sock, payload, length, MSG_NOSIGNAL) != length))
+    {
+        ret = -errno;
+        goto out;
+    }
+
+    ret = read_full(sock, &result, sizeof(result));
+    if (!ret) ret = result;
+
+out:
+    if (sock != -1) close(sock);
+    free(payload);
+    return ret;
+}
@@ -0,0 +1,193 @@
+/*
+ * This file implements the session counters and the "stats" builtin.
+ *
+ * The counters (commands run, builtin/function/external split, path cache
+ * hits, input bytes, parse time, and fork and exec latency histograms)
+ * live in one block of atomic words, updated without locks from the
+ * shell, its builtin threads and its forked children alike. The block is
+ * a MAP_SHARED mapping, so a child can record how long it took to reach
+ * exec, and counts from server mode requests reach the server.
+ *
+ * With --stats-shm=NAME, the block is the POSIX shared memory segment
+ * /dev/shm/NAME, which an external monitor can map read-only to watch a
+ * running shell. Its layout is struct stats_block below: a header (magic
+ * STATS_MAGIC, version STATS_VERSION, the shell's pid), STATS_COUNTERS
+ * unsigned longs indexed by the STAT_* numbers in thsh.h, then
+ * STATS_HISTOGRAMS histograms of STATS_BUCKETS unsigned longs each, where
+ * bucket k counts latencies of [2^k, 2^(k+1)) microseconds (bucket 0 also
+ * holds anything under a microsecond, the last one anything longer). The
+ * segment is removed when the shell exits.
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "thsh.h"
+
+#define STATS_MAGIC 0x74687374 // "thst"
+#define STATS_VERSION 1
+
+struct stats_block
+{
+    unsigned int magic;
+    unsigned int version;
+    int pid; // the shell that created the block
+    atomic_ulong counters[STATS_COUNTERS];
+    atomic_ulong histograms[STATS_HISTOGRAMS][STATS_BUCKETS];
+};
+
+// Until stats_init() maps the shared block, counts go to a private one
+static struct stats_block private_block;
+static struct stats_block *block = &private_block;
+static char *shm_name; // set once the segment is created, to remove it
+static int shell_pid;
+
+// Names printed by the stats builtin, by STAT_* number
+static const char *histogram_names[STATS_HISTOGRAMS] = {"fork", "exec"};
+
+// Removes the shared memory segment, from the shell that created it
+static void stats_unlink(void)
+{
+    if (getpid() == shell_pid) shm_unlink(shm_name);
+}
+
+/*
+ * Map the counters block shared with forked children, as the POSIX shared
+ * memory segment name ("/thsh" or "thsh") if it is not NULL, or an
+ * anonymous mapping otherwise. Counts made before this call are lost.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int stats_init(const char *name)
+{
+    struct stats_block *shared;
+    int fd = -1;
+
+    if (name)
+    {
+        if (!(shm_name = malloc(strlen(name) + 2))) return -ENOMEM;
+        sprintf(shm_name, "%s%s", (name[0] == '/') ? "" : "/", name);
+
+        fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) return -errno;
+        if (ftruncate(fd, sizeof(*block)))
+        {
+            int ret = -errno;
+            close(fd);
+            shm_unlink(shm_name);
+            return ret;
+        }
+    }
+
+    shared = mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE, name ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS,
+                  fd, 0);
+    if (fd != -1) close(fd);
+    if (shared == MAP_FAILED)
+    {
+        int ret = -errno;
+        if (name) shm_unlink(shm_name);
+        return ret;
+    }
+
+    shell_pid = getpid();
+    if (name && atexit(stats_unlink))
+    {
+        shm_unlink(shm_name);
+        return -ENOMEM;
+    }
+
+    // Written last, so a monitor that sees the magic sees a whole header
+    shared->version = STATS_VERSION;
+    shared->pid = shell_pid;
+    atomic_thread_fence(memory_order_release);
+    shared->magic = STATS_MAGIC;
+    block = shared;
+    return 0;
+}
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds
+long stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Adds n to counter (a STAT_* number)
+void stats_add(int counter, unsigned long n)
+{
+    atomic_fetch_add_explicit(&block->counters[counter], n, memory_order_relaxed);
+}
+
+// Counts a latency of ns nanoseconds in histogram (STAT_FORK or STAT_EXEC)
+void stats_latency(int histogram, long ns)
+{
+    int bucket = 0;
+
+    for (long us = ns / 1000; (us > 1) && (bucket < STATS_BUCKETS - 1); us >>= 1) bucket++;
+    atomic_fetch_add_explicit(&block->histograms[histogram][bucket], 1, memory_order_relaxed);
+}
+
+/*
+ * Handle the stats builtin: "stats" prints the session counters to
+ * stdout, "stats --reset" sets them all back to zero.
+ *
+ * Returns 0 on success, 2 for a usage error, -errno if writing failed.
+ */
+int handle_stats(char *args[MAX_ARGS], int stdin, int stdout)
+{
+    unsigned long c[STATS_COUNTERS]; // a snapshot; other processes may be counting
+    char report[2048];               // formatted here, as dprintf() would allocate
+    int length;
+
+    if (args[1] && (strcmp(args[1], "--reset") == 0) && !args[2])
+    {
+        for (int i = 0; i < STATS_COUNTERS; i++)
+            atomic_store_explicit(&block->counters[i], 0, memory_order_relaxed);
+        for (int h = 0; h < STATS_HISTOGRAMS; h++)
+            for (int i = 0; i < STATS_BUCKETS; i++)
+                atomic_store_explicit(&block->histograms[h][i], 0, memory_order_relaxed);
+        return 0;
+    }
+    if (args[1])
+    {
+        fprintf(stderr, "usage: stats [--reset]\n");
+        return 2;
+    }
+
+    for (int i = 0; i < STATS_COUNTERS; i++) c[i] = atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+
+    length = snprintf(report, sizeof(report),
+                      "pipelines    %lu\n"
+                      "commands     %lu (%lu builtin, %lu function, %lu external)\n"
+                      "path cache   %lu hits, %lu misses\n"
+                      "input        %lu bytes\n"
+                      "parse        %lu lines, %lu us (%lu ns/line)\n",
+                      c[STAT_PIPELINES], c[STAT_BUILTINS] + c[STAT_FUNCTIONS] + c[STAT_EXTERNALS],
+                      c[STAT_BUILTINS], c[STAT_FUNCTIONS], c[STAT_EXTERNALS], c[STAT_PATH_HITS],
+                      c[STAT_PATH_MISSES], c[STAT_BYTES_READ], c[STAT_LINES_PARSED], c[STAT_PARSE_NS] / 1000,
+                      c[STAT_LINES_PARSED] ? c[STAT_PARSE_NS] / c[STAT_LINES_PARSED] : 0);
+
+    // Only the buckets something fell into; the report holds them all
+    for (int h = 0; h < STATS_HISTOGRAMS; h++)
+    {
+        length += snprintf(report + length, sizeof(report) - length, "%s latency\n", histogram_names[h]);
+        for (int i = 0; i < STATS_BUCKETS; i++)
+        {
+            unsigned long count = atomic_load_explicit(&block->histograms[h][i], memory_order_relaxed);
+
+            if (!count) continue;
+            if (i == STATS_BUCKETS - 1)
+                length += snprintf(report + length, sizeof(report) - length, "  >= %lu us\t%lu\n", 1UL << i, count);
+            else
+                length += snprintf(report + length, sizeof(report) - length, "  %lu-%lu us\t%lu\n",
+                                   i ? 1UL << i : 0, (1UL << (i + 1)) - 1, count);
+        }
+    }
+
+    return write_all(stdout, report, length);
+}
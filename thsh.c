@@ -1,5 +1,6 @@
 #include "thsh.h"
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -9,35 +10,99 @@ int main(int argc, char **argv, char **envp)
     bool finished = 0;   // flag that the program should end
     int input_fd = 0;    // default to stdin
     int ret = 0;         // return value
-    bool debug_mode = 0; // debug flag
+    bool mem_mode = 0;   // allocation accounting flag
+    char *serve_path = NULL; // socket to serve command lines on
+    char *command = NULL;    // command line given with -c
+    char *stats_shm = NULL;  // shared memory segment to export counters in
+
+    // Builtins may write into pipes whose reader has exited; they should
+    // get EPIPE rather than kill the shell
+    signal(SIGPIPE, SIG_IGN);
 
     // Add support for parsing the -d option from the command line
     // and handling the case where a script is passed as input to your shell
 
-    if (argc > 1) // support for parsing the -d option. Debug flag set to 1
+    for (int arg = 1; arg < argc; arg++)
     {
-        if (strcmp(argv[1], "-d") == 0)
+        if (strcmp(argv[arg], "-d") == 0) // support for parsing the -d option. Debug flag set to 1
             debug_mode = 1;
 
-        else // support for the case where a script is passed as input to thsh
+        else if (strcmp(argv[arg], "-m") == 0) // count allocations per command line
+            mem_mode = 1;
+
+        else if (strncmp(argv[arg], "--trace=", strlen("--trace=")) == 0) // timeline as trace-event JSON
         {
-            // Setting input descriptor to read from script
-            char *script_name;
-            script_name = strdup(argv[1]);
+            ret = trace_open(argv[arg] + strlen("--trace="));
+            if (ret)
+            {
+                printf("Error opening the trace file: %d\n", ret);
+                return ret;
+            }
+        }
+
+        else if (strncmp(argv[arg], "--timeout=", strlen("--timeout=")) == 0) // deadline for every stage
+        {
+            default_timeout = parse_duration(argv[arg] + strlen("--timeout="));
+            if (default_timeout < 0)
+            {
+                printf("Invalid timeout: %s\n", argv[arg] + strlen("--timeout="));
+                return default_timeout;
+            }
+        }
+
+        else if (strncmp(argv[arg], "--affinity=", strlen("--affinity=")) == 0) // CPU placement of stages
+        {
+            default_affinity = affinity_parse(argv[arg] + strlen("--affinity="));
+            if (default_affinity < 0)
+            {
+                printf("Invalid affinity policy: %s\n", argv[arg] + strlen("--affinity="));
+                return default_affinity;
+            }
+        }
+
+        else if (strncmp(argv[arg], "--stats-shm=", strlen("--stats-shm=")) == 0) // counters for monitors
+            stats_shm = argv[arg] + strlen("--stats-shm=");
+
+        else if ((strcmp(argv[arg], "-c") == 0) && (arg + 1 < argc)) // run one command line and exit
+            command = argv[++arg];
 
-            input_fd = open(script_name, O_RDONLY);
+        else if ((strcmp(argv[arg], "--serve") == 0) && (arg + 1 < argc)) // resident server mode
+            serve_path = argv[++arg];
+
+        else if ((strcmp(argv[arg], "--connect") == 0) && (arg + 1 < argc)) // client of a resident server
+        {
+            ret = serve_connect(argv[arg + 1], &argv[arg + 2]);
+            if (ret < 0) printf("Error connecting to the server: %d\n", ret);
+            return ret;
+        }
+
+        else if (!input_fd) // support for the case where a script is passed as input to thsh
+        {
+            // Setting input descriptor to read from script
+            input_fd = open(argv[arg], O_RDONLY);
             if (input_fd == -1)
             {
                 printf("Error opening the file\n");
                 return -errno;
             }
-            if (argc > 2) // support for the case where a script is passed
-            {             // as input to thsh and debug mode is on
+        }
+    }
 
-                if (strcmp(argv[2], "-d") == 0)
-                    debug_mode = 1;
-            }
+    // With -c, skip the start-up work: the current directory and the path
+    // table are initialized on first use, and the last stage replaces thsh
+    if (command)
+    {
+        if (mem_mode && ((ret = mem_accounting_init())))
+        {
+            printf("Error initializing allocation accounting: %d\n", ret);
+            return ret;
         }
+        if (stats_shm && ((ret = stats_init(stats_shm))))
+        {
+            printf("Error initializing the stats counters: %d\n", ret);
+            return ret;
+        }
+        return run_string(command, !mem_mode && !trace_enabled() && !stats_shm);
     }
 
     // Initializong current directory
@@ -56,17 +121,48 @@ int main(int argc, char **argv, char **envp)
         return ret;
     }
 
+    // Counters shared with our children (and exported, with --stats-shm)
+    ret = stats_init(stats_shm);
+    if (ret)
+    {
+        printf("Error initializing the stats counters: %d\n", ret);
+        return ret;
+    }
+
+    // In server mode, the warm shell serves clients until it is killed
+    if (serve_path)
+    {
+        ret = serve(serve_path);
+        printf("Error serving on the socket: %d\n", ret);
+        return ret;
+    }
+
+    // Start counting allocations once start-up is done
+    if (mem_mode)
+    {
+        ret = mem_accounting_init();
+        if (ret)
+        {
+            printf("Error initializing allocation accounting: %d\n", ret);
+            return ret;
+        }
+    }
+
+    // Buffers for the input line and its stages, grown by the longest
+    // line so far and reused
+    char *buf = NULL;
+    size_t buf_size = 0;
+    struct command_table parsed = {NULL, 0};
+
     while (!finished)
     {
         int length;
-        // Buffer to hold input
-        char cmd[MAX_INPUT];
-        // Get a pointer to cmd that type-checks with char *
-        char *buf = &cmd[0];
-        char *parsed_commands[MAX_PIPELINE][MAX_ARGS];
         char *infile = NULL;
         char *outfile = NULL;
         int pipeline_steps = 0;
+        int status = 0;        // exit status of the last stage
+        long parse_start = 0;  // for the parse span when tracing
+        long parse_ns = 0;     // for the parse time counter
 
         if (!input_fd)
         {
@@ -81,121 +177,44 @@ int main(int argc, char **argv, char **envp)
         }
 
         // Read a line of input
-        length = read_one_line(input_fd, buf, MAX_INPUT);
+        length = read_line(input_fd, &buf, &buf_size);
         if (length <= 0)
         {
             ret = length;
             break;
         }
+        mem_line_begin();
 
-        // Pass it to the parser
-        pipeline_steps = parse_line(buf, length, parsed_commands, &infile, &outfile);
-        if (pipeline_steps <= 0)
+        // A function definition may continue on the lines that follow
+        if (definition_start(buf))
         {
-            printf("Parsing error. Cannot execute command. %d\n", -pipeline_steps);
+            ret = define_function(input_fd, buf, length);
+            if (ret) printf("Parsing error. Cannot execute command. %d\n", -ret);
+            mem_line_end(debug_mode);
             continue;
         }
 
-        // Default settings
-        int val = 0;       // return value from builtin command
-        int rv = 0;        // return value when creating a pipe
-        bool wait = false; // after fork, sets parent process to wait or not
-        int std_in = 0;    // std_in is a file handle to be used as a param in run_command
-        int std_out = 1;   // std_out is a file handle to be used as a param in run_command
-        int in_file = 0;   // temp infile handle
-        int out_file = 1;  // temp outfile handle
-
-        // Redirection file
-        if (infile)
-        {
-            // Read from file
-            in_file = open(infile, O_RDONLY);
-        }
-        if (outfile)
+        // Pass it to the parser
+        parse_start = trace_now();
+        parse_ns = stats_now();
+        pipeline_steps = parse_line(buf, length, &parsed, &infile, &outfile);
+        stats_add(STAT_PARSE_NS, stats_now() - parse_ns);
+        stats_add(STAT_LINES_PARSED, 1);
+        trace_span("parse", 0, parse_start, trace_now(), NULL);
+        if (pipeline_steps <= 0)
         {
-            // Write to file
-            out_file = open(outfile, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+            printf("Parsing error. Cannot execute command. %d\n", -pipeline_steps);
+            mem_line_end(debug_mode);
+            continue;
         }
 
         // Handle simple commands, redirection and piping
-        int pipe_fd[2]; // array that holds pipe pointers
-
-        for (int i = 0; i < pipeline_steps; i++) // going through each of the commands in parsed_commands
-        {
-            // Checking for debug flag
-            if (debug_mode) fprintf(stderr, "RUNNING: [%s]\n", *parsed_commands[i]);
-
-            if (i == 0) // first command in pipe, only reads if needed, writes
-            {           // to new pipe if pipeline_steps > 1, no need to wait
-
-                std_in = in_file; // read from file if needed
-
-                if (pipeline_steps > 1)
-                {
-                    rv = pipe(pipe_fd);   // create new pipe
-                    std_out = pipe_fd[1]; // write to pipe
-                    wait = false;
-                }
-            }
-            if (i == pipeline_steps - 1) // last command in pipe, read from old pipe if 
-            {                            // pipeline_steps > 1, output to file if needed, needs to wait
-
-                std_out = out_file; // write to file if needed
-                wait = true;
-
-                if (pipeline_steps > 1)
-                {
-                    std_in = pipe_fd[0]; // read from old pipe
-                }
-            }
-            if ((i != 0) && (i != pipeline_steps - 1)) // command in the middle of pipe, reads from
-            {                                          // old pipe, writes to new pipe, no need to wait
-
-                std_in = pipe_fd[0];  // read from old pipe
-                rv = pipe(pipe_fd);   // create new pipe
-                std_out = pipe_fd[1]; // write to new pipe
-            }
-
-            // Run command if no errors opening files or pipes
-            if ((rv == 0) && (std_in != -1) && (std_out != -1))
-            {
-                // Handling builtin commands
-                ret = handle_builtin(*parsed_commands, input_fd, out_file, &val);
-
-                if (ret == 1) // if it is a builtin command, then ret = val returned by builtin command
-                {
-                    ret = val;
-                }
-                else // not a builtin command
-                {
-                    ret = run_command(parsed_commands[i], std_in, std_out, wait);
-                }
-
-                // Closing pipes, if any
-                if ((pipeline_steps > 1) && (i < pipeline_steps - 1))
-                {
-                    close(std_out);
-                }
-            }
-            else // error opening files or pipes, set ret to -errno
-            {
-                ret = -errno;
-                break;
-            }
-
-            // If error returned when running command, break loop
-            if (ret) break;
-
-            // Debug mode ending
-            if (debug_mode) fprintf(stderr, "ENDED: [%s] (ret=%d)\n", *parsed_commands[i], ret);
-        }
-
-        // Close file handlers if exist
-        if (infile) close(in_file);
-        if (outfile) close(out_file);
+        ret = run_pipeline(parsed.commands, pipeline_steps, infile, outfile, false, &status);
 
         // Do not change this if/printf
         if (ret) printf("Failed to run command - error %d\n", ret);
+
+        mem_line_end(debug_mode);
     }
     return ret;
 }
@@ -8,29 +8,130 @@
 #include <errno.h>
 #include <assert.h>
 
-// Assume no input line will be longer than 1024 bytes
+// Initial size of a line buffer (read_line() grows it), and size of path buffers
 #define MAX_INPUT 1024
 
-// Assume a pipeline will never be longer than 32 stages
-#define MAX_PIPELINE 32
-
 // Assume any individual command will not have more than 16 arguments
 #define MAX_ARGS 16
 
+// Functions calling functions (or sourcing files) can nest this deep
+#define MAX_CALL_DEPTH 64
+
+// The stages of a parsed line, for any number of stages: commands[i] is
+// stage i. Grown by parse_line() and reused from line to line
+struct command_table
+{
+    char *(*commands)[MAX_ARGS];
+    int capacity; // entries allocated in commands
+};
+
 // Helper functions
 // In parse.c:
 int read_one_line(int input_fd, char *buf, size_t size);
-int parse_line(char *inbuf, size_t length, char *commands[MAX_PIPELINE][MAX_ARGS],
+int read_line(int input_fd, char **buf, size_t *size);
+int parse_line(char *inbuf, size_t length, struct command_table *table,
                char **infile, char **outfile);
 
+// In affinity.c:
+#define AFFINITY_NONE 0    // stages run wherever the kernel puts them
+#define AFFINITY_COMPACT 1 // adjacent stages on neighbouring cores
+#define AFFINITY_SPREAD 2  // adjacent stages on different packages
+extern int default_affinity;
+int affinity_parse(const char *name);
+int affinity_cpu(int policy, int stage);
+int affinity_pin(int cpu);
+
 // In builtin.c:
+#define BUILTIN_NONE 0     // not a builtin
+#define BUILTIN_PURE 1     // only uses its stdin and stdout
+#define BUILTIN_STATEFUL 2 // changes the shell's own state
+
 int init_cwd(void);
+const char *current_dir(void);
+int builtin_kind(char *args[MAX_ARGS]);
 int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval);
 int print_prompt(void);
+int write_all(int fd, const char *text, size_t length);
+
+// In cache.c:
+int handle_cache(char *args[MAX_ARGS], int stdin, int stdout);
+
+// In func.c:
+bool definition_start(const char *line);
+int define_function(int input_fd, const char *first_line, int length);
+bool function_defined(const char *name);
+int run_function(char *args[MAX_ARGS], bool exec_last, int *status);
+int handle_source(char *args[MAX_ARGS], int stdin, int stdout);
+int run_string(char *commands, bool exec_last);
 
 // In jobs.c:
+extern bool debug_mode;
+extern long default_timeout;
+long parse_duration(const char *text);
+int wait_child(int pid, const char *name, int *wstatus);
 int init_path(void);
 void print_path_table(void);
 int run_command(char *args[MAX_ARGS], int stdin, int stdout, bool wait);
+int spawn_command(char *args[MAX_ARGS], int stdin, int stdout, int cpu, int pgid, int *exec_fd);
+int run_pipeline(char *commands[][MAX_ARGS], int steps, char *infile, char *outfile,
+                 bool exec_last, int *status);
+int exit_status(int wstatus);
+
+// In mem.c:
+int mem_accounting_init(void);
+void mem_line_begin(void);
+void mem_line_end(bool report);
+
+// In scan.c:
+#define SCAN_BLOCK 64 // bytes classified by one scan_block() call
+
+// One bit per byte of a block, for each class of delimiter
+struct scan_masks
+{
+    unsigned long long newline; // '\n'
+    unsigned long long comment; // '#'
+    unsigned long long pipe;    // '|'
+    unsigned long long in;      // '<'
+    unsigned long long out;     // '>'
+    unsigned long long quote;   // '"' and '\''
+    unsigned long long space;   // ' ' and '\t'
+    unsigned long long nul;     // '\0'
+};
+void scan_block(const char *block, struct scan_masks *masks);
+int scan_select(const char *name);
+const char *scan_name(void);
+
+// In serve.c:
+int serve(const char *path);
+int serve_connect(const char *path, char **args);
+
+// In stats.c: counters (STAT_*) and latency histograms, see stats_init()
+#define STAT_PIPELINES 0
+#define STAT_BUILTINS 1     // stages run by a builtin
+#define STAT_FUNCTIONS 2    // calls of shell functions
+#define STAT_EXTERNALS 3    // stages run by an external command
+#define STAT_PATH_HITS 4    // command names found in the path cache
+#define STAT_PATH_MISSES 5  // command names looked up on PATH
+#define STAT_BYTES_READ 6   // bytes of the shell's input or script returned by read_one_line(),
+                            // function bodies defined there included; not sourced files or -c
+#define STAT_LINES_PARSED 7
+#define STAT_PARSE_NS 8     // time spent in parse_line()
+#define STATS_COUNTERS 9
+#define STAT_FORK 0         // time the shell is blocked in fork()
+#define STAT_EXEC 1         // time from fork() until the child is about to exec
+#define STATS_HISTOGRAMS 2
+#define STATS_BUCKETS 16    // bucket k: [2^k, 2^(k+1)) microseconds
+int stats_init(const char *name);
+long stats_now(void);
+void stats_add(int counter, unsigned long n);
+void stats_latency(int histogram, long ns);
+int handle_stats(char *args[MAX_ARGS], int stdin, int stdout);
+
+// In trace.c:
+int trace_open(const char *filename);
+bool trace_enabled(void);
+long trace_now(void);
+void trace_span(const char *name, int tid, long start, long end, char *args[MAX_ARGS]);
+void trace_instant(const char *name, int tid, long ts, const char *key, long value);
 
 #endif // THSH_H
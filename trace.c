@@ -0,0 +1,144 @@
+/*
+ * This file implements the timeline tracer (thsh --trace=file.json).
+ *
+ * Events are timestamped with CLOCK_MONOTONIC, relative to when tracing
+ * started, and streamed to the trace file in the Chrome trace-event JSON
+ * format, so a run can be opened in chrome://tracing or Perfetto.
+ *
+ * Lane (tid) 0 is the shell itself (parsing, waiting); lane N is pipeline
+ * stage N, so stages of successive pipelines line up under each other.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "thsh.h"
+
+static FILE *trace_file = NULL;
+static struct timespec trace_start;
+static int trace_pid;
+static int named_lanes = 0; // lanes [0, named_lanes) already have a name
+
+// Returns true if --trace was given
+bool trace_enabled(void)
+{
+    return trace_file != NULL;
+}
+
+// Returns the current time in microseconds since tracing started
+long trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace_start.tv_sec) * 1000000L + (now.tv_nsec - trace_start.tv_nsec) / 1000;
+}
+
+// Writes str as the body of a JSON string, escaping as needed
+static void write_escaped(const char *str)
+{
+    for (; *str; str++)
+    {
+        if ((*str == '"') || (*str == '\\')) fprintf(trace_file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(trace_file, "\\u%04x", *str);
+        else fputc(*str, trace_file);
+    }
+}
+
+// Writes a metadata event naming every lane up to and including tid
+static void name_lanes(int tid)
+{
+    for (; named_lanes <= tid; named_lanes++)
+    {
+        fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                            "\"args\":{\"name\":\"",
+                trace_pid, named_lanes);
+        if (named_lanes) fprintf(trace_file, "stage %d", named_lanes);
+        else fprintf(trace_file, "thsh");
+        fprintf(trace_file, "\"}}");
+    }
+}
+
+// Closes the JSON array and the file; registered with atexit(), so it is
+// skipped in forked children that leave through exit()
+static void trace_close(void)
+{
+    if (!trace_file || (getpid() != trace_pid)) return;
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+/*
+ * Start tracing into filename, truncating it.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int trace_open(const char *filename)
+{
+    int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) return -errno;
+
+    trace_file = fdopen(fd, "w");
+    if (!trace_file)
+    {
+        close(fd);
+        return -errno;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    trace_pid = getpid();
+
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"thsh\"}}",
+            trace_pid);
+    name_lanes(0);
+
+    if (atexit(trace_close)) return -ENOMEM;
+    return 0;
+}
+
+/*
+ * Record a span (a "complete" event) called name on lane tid, from start
+ * to end (microseconds, from trace_now()). If args is not NULL, the words
+ * are joined and attached to the event as its command line.
+ */
+void trace_span(const char *name, int tid, long start, long end, char *args[MAX_ARGS])
+{
+    if (!trace_file) return;
+    name_lanes(tid);
+
+    fprintf(trace_file, ",\n{\"name\":\"");
+    write_escaped(name);
+    fprintf(trace_file, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld,\"dur\":%ld", trace_pid, tid, start,
+            end - start);
+    if (args)
+    {
+        fprintf(trace_file, ",\"args\":{\"command\":\"");
+        for (int i = 0; args[i]; i++)
+        {
+            if (i) fputc(' ', trace_file);
+            write_escaped(args[i]);
+        }
+        fprintf(trace_file, "\"}");
+    }
+    fprintf(trace_file, "}");
+}
+
+/*
+ * Record an instant event called name on lane tid at time ts. If key is
+ * not NULL, value is attached under it (e.g., a pid or an exit status).
+ */
+void trace_instant(const char *name, int tid, long ts, const char *key, long value)
+{
+    if (!trace_file) return;
+    name_lanes(tid);
+
+    fprintf(trace_file, ",\n{\"name\":\"");
+    write_escaped(name);
+    fprintf(trace_file, "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%ld", trace_pid, tid, ts);
+    if (key) fprintf(trace_file, ",\"args\":{\"%s\":%ld}", key, value);
+    fprintf(trace_file, "}");
+}